@@ -0,0 +1,90 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+#include "lualib.h"
+
+#define BENCH_SCRIPT	"bench.lua"
+#define BENCH_TIME		0.5
+
+LUALIB_API int luaopen_stream (lua_State *L);
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static double run(lua_State *L, int idx, long n)
+{
+	double t;
+	lua_getfield(L, idx, "run");
+	lua_pushnumber(L, n);
+	t = now();
+	if (lua_pcall(L, 1, 0, 0))
+	{
+		fprintf(stderr, "bench: %s\n", lua_tostring(L, -1));
+		exit(1);
+	}
+	return now() - t;
+}
+
+static double field(lua_State *L, int idx, const char *k)
+{
+	double n;
+	lua_getfield(L, idx, k);
+	n = lua_tonumber(L, -1);
+	lua_pop(L, 1);
+	return n;
+}
+
+/* one JSON object per line: corpus, op, iterations, seconds, bytes, objects, mbps, objps */
+int main(int argc, char *argv[])
+{
+	const char *script = argc > 1 ? argv[1] : BENCH_SCRIPT;
+	double mintime = argc > 2 ? atof(argv[2]) : BENCH_TIME;
+	int i, cases;
+	lua_State *L = luaL_newstate();
+	luaL_openlibs(L);
+
+	lua_getglobal(L, "package");
+	lua_getfield(L, -1, "preload");
+	lua_pushcfunction(L, luaopen_stream);
+	lua_setfield(L, -2, "stream");
+	lua_pop(L, 2);
+
+	if (luaL_loadfile(L, script) || lua_pcall(L, 0, 1, 0))
+	{
+		fprintf(stderr, "bench: %s\n", lua_tostring(L, -1));
+		return 1;
+	}
+	cases = lua_gettop(L);
+	for (i = 1; ; ++i)
+	{
+		int top = lua_gettop(L);
+		long n = 1;
+		double t, bytes, objects;
+		lua_pushnumber(L, i);
+		lua_gettable(L, cases);
+		if (lua_isnil(L, -1))
+			break;
+		run(L, top + 1, 1);
+		while ((t = run(L, top + 1, n)) < mintime)
+			n = t > mintime / 8 ? (long)(n * mintime * 1.2 / t) + 1 : n * 8;
+		bytes = field(L, top + 1, "bytes") * n;
+		objects = field(L, top + 1, "objects") * n;
+		lua_getfield(L, top + 1, "corpus");
+		lua_getfield(L, top + 1, "op");
+		printf("{\"corpus\":\"%s\",\"op\":\"%s\",\"iterations\":%ld,\"seconds\":%.6f,"
+			"\"bytes\":%.0f,\"objects\":%.0f,\"mbps\":%.3f,\"objps\":%.1f}\n",
+			lua_tostring(L, -2), lua_tostring(L, -1), n, t,
+			bytes, objects, bytes / t / (1024 * 1024), objects / t);
+		fflush(stdout);
+		lua_settop(L, top);
+	}
+	lua_close(L);
+	return 0;
+}
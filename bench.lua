@@ -0,0 +1,169 @@
+-- benchmark corpus for bench.c, returns a list of cases
+-- each case: corpus, op, bytes and objects per iteration, run(n)
+
+local stream = require 'stream'
+
+local function objects(v, seen)
+	if type(v) ~= 'table' then return 1 end
+	seen = seen or {}
+	if seen[v] then return 1 end
+	seen[v] = true
+	local n = 1
+	for k, x in pairs(v) do
+		n = n + objects(k, seen) + objects(x, seen)
+	end
+	return n
+end
+
+local corpus = {}
+
+corpus.flat = {}
+for i = 1, 1024 do
+	corpus.flat[i] = i % 3 == 0 and i * 0.25 or i * 7
+end
+
+corpus.nested = {}
+do
+	local node = corpus.nested
+	for i = 1, 64 do
+		node.depth = i
+		node.items = i % 8
+		node.next = {}
+		node = node.next
+	end
+end
+
+corpus.records = {}
+for i = 1, 200 do
+	corpus.records[i] = {
+		id = i,
+		name = 'user' .. i,
+		score = i * 1.25,
+		active = i % 2 == 0,
+		kind = i % 5,
+	}
+end
+
+corpus.cyclic = {}
+for i = 1, 128 do
+	corpus.cyclic[i] = {id = i}
+end
+for i = 1, 128 do
+	local node = corpus.cyclic[i]
+	node.next = corpus.cyclic[i % 128 + 1]
+	node.prev = corpus.cyclic[(i - 2) % 128 + 1]
+	node.link = corpus.cyclic[(i * 37) % 128 + 1]
+end
+
+corpus.bigstring = string.rep('abcdefgh', 131072)
+
+local order = {'flat', 'nested', 'records', 'cyclic', 'bigstring'}
+local cases = {}
+
+local function add(name, op, bytes, nobjs, run)
+	cases[#cases + 1] = {corpus = name, op = op, bytes = bytes, objects = nobjs, run = run}
+end
+
+for _, name in ipairs(order) do
+	local v = corpus[name]
+	local enc = stream.new()
+	enc:write(v)
+	local bytes, nobjs = enc:size(), objects(v)
+
+	add(name, 'write', bytes, nobjs, function(n)
+		local s = stream.new()
+		for i = 1, n do
+			s:write(v)
+			s:remove(0, bytes)
+		end
+	end)
+
+	add(name, 'read', bytes, nobjs, function(n)
+		for i = 1, n do
+			enc:seek(0)
+			enc:read()
+		end
+	end)
+
+	-- insert in front of an existing copy, then drop it again
+	add(name, 'insert', bytes, nobjs, function(n)
+		local s = stream.new()
+		s:write(v)
+		for i = 1, n do
+			s:insert(0, v)
+			s:remove(0, bytes)
+		end
+	end)
+
+	add(name, 'extract', bytes, nobjs, function(n)
+		local s = stream.new()
+		for i = 1, n do
+			enc:seek(0)
+			s:extract(enc)
+			s:remove(0, bytes)
+		end
+	end)
+end
+
+-- writef/readf over the same records, one record per call
+do
+	local recs = corpus.records
+	local fmt = 'DfzBB'
+	local enc = stream.new()
+	for _, r in ipairs(recs) do
+		enc:writef(fmt, r.id, r.score, r.name, r.active and 1 or 0, r.kind)
+	end
+	local bytes = enc:size()
+
+	add('records', 'writef', bytes, #recs * 5, function(n)
+		local s = stream.new()
+		for i = 1, n do
+			for _, r in ipairs(recs) do
+				s:writef(fmt, r.id, r.score, r.name, r.active and 1 or 0, r.kind)
+			end
+			s:remove(0, bytes)
+		end
+	end)
+
+	add('records', 'readf', bytes, #recs * 5, function(n)
+		for i = 1, n do
+			enc:seek(0)
+			for j = 1, #recs do
+				enc:readf(fmt)
+			end
+		end
+	end)
+end
+
+-- flat numbers through writef/readf in chunks of 16
+do
+	local flat = corpus.flat
+	local fmt = string.rep('f', 16)
+	local unpack = unpack or table.unpack
+	local enc = stream.new()
+	for i = 1, #flat, 16 do
+		enc:writef(fmt, unpack(flat, i, i + 15))
+	end
+	local bytes = enc:size()
+
+	add('flat', 'writef', bytes, #flat, function(n)
+		local s = stream.new()
+		for i = 1, n do
+			for j = 1, #flat, 16 do
+				s:writef(fmt, unpack(flat, j, j + 15))
+			end
+			s:remove(0, bytes)
+		end
+	end)
+
+	add('flat', 'readf', bytes, #flat, function(n)
+		for i = 1, n do
+			enc:seek(0)
+			for j = 1, #flat, 16 do
+				enc:readf(fmt)
+			end
+		end
+	end)
+end
+
+return cases
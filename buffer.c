@@ -1,5 +1,14 @@
 
+#ifdef __linux__
+#define _GNU_SOURCE
+#include <sys/mman.h>
+#define BUFFER_MMAP
+#endif
+
 #include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <malloc.h>
 #include <assert.h>
 
@@ -14,33 +23,124 @@
 
 #define _self (*self)
 
+/* buffers from this size on live in anonymous hugepage mappings */
+#define MMAP_MIN	(2 << 20)
+
+#ifdef STREAM_STATS
+STATS_TLS struct buffer_stats buffer_stats;
+#endif
+
 struct buffer_
 {
 	size_t pos;
 	size_t size;
+	float growth;
+	int mapped;
 	char ptr[0];
 };
 
+/* callers write into the grown buffer unchecked, running on without it is not an option */
+static void buffer_oom(size_t bytes)
+{
+	fprintf(stderr, "buffer: out of memory growing to %lu bytes\n", (unsigned long)bytes);
+	abort();
+}
+
+#ifdef BUFFER_MMAP
+static buffer_t buffer_map(size_t bytes)
+{
+	void *ptr = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ptr == MAP_FAILED)
+		return NULL;
+	madvise(ptr, bytes, MADV_HUGEPAGE);
+	return (buffer_t)ptr;
+}
+#endif
+
+/* moves the storage to exactly size bytes of capacity, switching between heap and mapping */
+static void buffer_resize(buffer_t *self, size_t size)
+{
+	size_t bytes = sizeof(struct buffer_) + size;
+	assert(size >= _self->pos);
+#ifdef BUFFER_MMAP
+	if (_self->mapped && bytes >= MMAP_MIN)
+	{
+		void *ptr = mremap(_self, sizeof(struct buffer_) + _self->size, bytes, MREMAP_MAYMOVE);
+		if (ptr != MAP_FAILED)
+		{
+			_self = (buffer_t)ptr;
+			madvise(ptr, bytes, MADV_HUGEPAGE);
+			_self->size = size;
+			return;
+		}
+	}
+	if (_self->mapped || bytes >= MMAP_MIN)
+	{
+		buffer_t other = bytes >= MMAP_MIN ? buffer_map(bytes) : NULL;
+		int mapped = other != NULL;
+		/* no mapping to be had, a heap copy does */
+		if (!other)
+			other = (buffer_t)malloc(bytes);
+		if (!other)
+			buffer_oom(bytes);
+		memcpy(other, _self, sizeof(struct buffer_) + _self->pos);
+		if (_self->mapped)
+			munmap(_self, sizeof(struct buffer_) + _self->size);
+		else
+			free(_self);
+		_self = other;
+		_self->mapped = mapped;
+		_self->size = size;
+		return;
+	}
+#endif
+	{
+		buffer_t other = (struct buffer_*)realloc(_self, bytes);
+		if (!other)
+			buffer_oom(bytes);
+		_self = other;
+		_self->size = size;
+	}
+}
+
 buffer_t buffer_new(size_t size)
 {
-	buffer_t self = (buffer_t)malloc(sizeof(struct buffer_) + size);
+	buffer_t self = (buffer_t)malloc(sizeof(struct buffer_));
+	if (!self)
+		buffer_oom(sizeof(struct buffer_));
 	self->pos = 0;
-	self->size = size;
+	self->size = 0;
+	self->growth = 2;
+	self->mapped = 0;
+	buffer_resize(&self, size);
 	return self;
 }
 
 void buffer_delete(buffer_t *self)
 {
-	free(_self);
+#ifdef BUFFER_MMAP
+	if (_self->mapped)
+		munmap(_self, sizeof(struct buffer_) + _self->size);
+	else
+#endif
+		free(_self);
 	_self = NULL;
 }
 
+void buffer_setgrowth(buffer_t *self, float growth)
+{
+	assert(growth > 1);
+	_self->growth = growth;
+}
+
 void buffer_needsize(buffer_t *self, size_t size)
 {
 	if (_self->pos + size > _self->size)
 	{
-		_self->size += MAX(size, _self->size);
-		_self = (struct buffer_*)realloc(_self, sizeof(struct buffer_) + _self->size);
+		size_t grow = (size_t)(_self->size * (_self->growth - 1));
+		buffer_resize(self, _self->size + MAX(size, grow));
+		STAT(buffer_stats.reallocs++);
+		STAT(buffer_stats.realloc_bytes += _self->size);
 	}
 }
 
@@ -48,11 +148,28 @@ void buffer_checksize(buffer_t *self, size_t size)
 {
 	if (size > _self->size)
 	{
-		_self->size += size;
-		_self = (struct buffer_*)realloc(_self, sizeof(struct buffer_) + _self->size);
+		buffer_resize(self, _self->size + size);
+		STAT(buffer_stats.reallocs++);
+		STAT(buffer_stats.realloc_bytes += _self->size);
 	}
 }
 
+void buffer_reserve(buffer_t *self, size_t size)
+{
+	if (size > _self->size)
+	{
+		buffer_resize(self, size);
+		STAT(buffer_stats.reallocs++);
+		STAT(buffer_stats.realloc_bytes += _self->size);
+	}
+}
+
+void buffer_shrink(buffer_t *self)
+{
+	if (_self->pos < _self->size)
+		buffer_resize(self, _self->pos);
+}
+
 void buffer_writebyte(buffer_t *self, char ch)
 {
 	buffer_needsize(self, 1);
@@ -87,6 +204,8 @@ void buffer_insert(buffer_t *self, size_t pos, const void *data, size_t size)
 	assert(pos <= _self->pos);
 	buffer_needsize(self, size);
 	memmove(_self->ptr + pos + size, _self->ptr + pos, _self->pos - pos);
+	STAT(buffer_stats.inserts++);
+	STAT(buffer_stats.insert_moved += _self->pos - pos);
 	memcpy(_self->ptr + pos, data, size);
 	if (_self->pos >= pos) _self->pos += size;
 }
@@ -95,9 +214,23 @@ void buffer_remove(buffer_t *self, size_t pos, size_t size)
 {
 	assert(pos + size <= _self->pos);
 	memmove(_self->ptr + pos, _self->ptr + pos + size, _self->pos - pos - size);
+	STAT(buffer_stats.removes++);
+	STAT(buffer_stats.remove_moved += _self->pos - pos - size);
 	_self->pos -= size;
 }
 
+char *buffer_prepare(buffer_t *self, size_t size)
+{
+	buffer_needsize(self, size);
+	return _self->ptr + _self->pos;
+}
+
+void buffer_commit(buffer_t *self, size_t size)
+{
+	assert(_self->pos + size <= _self->size);
+	_self->pos += size;
+}
+
 size_t buffer_size(buffer_t *self)
 {
 	return _self->size;
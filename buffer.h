@@ -1,16 +1,43 @@
 
 typedef struct buffer_ *buffer_t;
 
+#ifdef STREAM_STATS
+#ifdef _MSC_VER
+#define STATS_TLS __declspec(thread)
+#else
+#define STATS_TLS __thread
+#endif
+#define STAT(expr) (expr)
+
+struct buffer_stats {
+	size_t reallocs;
+	size_t realloc_bytes;
+	size_t inserts;
+	size_t insert_moved;
+	size_t removes;
+	size_t remove_moved;
+};
+
+extern STATS_TLS struct buffer_stats buffer_stats;
+#else
+#define STAT(expr) ((void)0)
+#endif
+
 buffer_t buffer_new(size_t size);
 void buffer_delete(buffer_t *self);
 void buffer_needsize(buffer_t *self, size_t size);
 void buffer_checksize(buffer_t *self, size_t size);
+void buffer_reserve(buffer_t *self, size_t size);
+void buffer_shrink(buffer_t *self);
+void buffer_setgrowth(buffer_t *self, float growth);
 void buffer_writebyte(buffer_t *self, char ch);
 void buffer_write(buffer_t *self, const void *data, size_t size);
 void buffer_read(buffer_t *self, size_t pos, void* data, size_t size);
 void buffer_insertbyte(buffer_t *self, size_t pos, char ch);
 void buffer_insert(buffer_t *self, size_t pos, const void *data, size_t size);
 void buffer_remove(buffer_t *self, size_t pos, size_t size);
+char *buffer_prepare(buffer_t *self, size_t size);
+void buffer_commit(buffer_t *self, size_t size);
 size_t buffer_tell(buffer_t *self);
 size_t buffer_size(buffer_t *self);
 char *buffer_ptr(buffer_t *self);
@@ -0,0 +1,172 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+#include "lualib.h"
+
+#include "stream.h"
+
+/* checks for the lua free C API of stream.h, same output as test.lua */
+
+LUALIB_API int luaopen_stream (lua_State *L);
+
+static int failed = 0;
+
+#define check(c) check_line(c, __LINE__)
+
+static void check_line(int ok, int line)
+{
+	if (ok)
+		printf("[ok]\n");
+	else
+		printf("[failed] %s:%d\n", __FILE__, line);
+	failed |= !ok;
+}
+
+static int string_is(stream_Iter *it, const char *str)
+{
+	const char *s;
+	size_t len;
+	return stream_get_string(it, &s, &len) && len == strlen(str) && memcmp(s, str, len) == 0;
+}
+
+/* put_* then get_* give the same values back, and lua reads them as written */
+static void roundtrip(lua_State *L)
+{
+	lua_Stream *s = stream_alloc(), *ls;
+	stream_Iter it;
+	lua_Integer n;
+	lua_Number x;
+	char big[300];
+	const char *str;
+	size_t len;
+	int b;
+	memset(big, 'b', sizeof(big));
+	stream_begin_table(s);
+	stream_put_string(s, "id", 2);
+	stream_put_int(s, 42);
+	stream_put_string(s, "big", 3);
+	stream_put_string(s, big, sizeof(big));
+	stream_put_string(s, "x", 1);
+	stream_put_number(s, 2.5);
+	stream_put_string(s, "ok", 2);
+	stream_put_bool(s, 1);
+	stream_end_table(s);
+	stream_begin_array(s);
+	stream_put_int(s, -1);
+	stream_put_int(s, (lua_Integer)1 << 40);
+	stream_put_nil(s);
+	stream_end_array(s);
+
+	stream_iter(s, &it);
+	check(stream_next(&it) == STREAM_TTABLE && stream_next(&it) == STREAM_TDELIMITER);
+	check(string_is(&it, "id") && !stream_get_string(&it, &str, &len) && stream_get_int(&it, &n) && n == 42);
+	check(string_is(&it, "big") && stream_get_string(&it, &str, &len) && len == sizeof(big) && memcmp(str, big, len) == 0);
+	check(string_is(&it, "x") && !stream_get_int(&it, &n) && stream_get_number(&it, &x) && x == 2.5);
+	check(string_is(&it, "ok") && stream_get_bool(&it, &b) && b == 1);
+	check(stream_next(&it) == STREAM_TEND && stream_next(&it) == STREAM_TTABLE);
+	check(stream_get_int(&it, &n) && n == -1 && stream_get_number(&it, &x) && x == (lua_Number)((lua_Integer)1 << 40));
+	check(stream_next(&it) == STREAM_TNIL && stream_next(&it) == STREAM_TDELIMITER && stream_next(&it) == STREAM_TEND);
+	check(stream_next(&it) == STREAM_TNONE && it.pos == stream_size(s));
+
+	ls = stream_new(L);
+	stream_write(ls, stream_ptr(s), stream_size(s));
+	stream_push(L, ls);
+	lua_setglobal(L, "s");
+	check(luaL_dostring(L,
+		"local t, a = s:read(2) "
+		"return t.id == 42 and #t.big == 300 and t.x == 2.5 and t.ok == true and a[1] == -1 and a[2] == 2^40 and #a == 2"
+		) == 0 && lua_toboolean(L, -1));
+	lua_pop(L, 1);
+	stream_unref(L, ls);
+	stream_free(s);
+}
+
+/* every cut of an item gives STREAM_TERROR and leaves the position alone */
+static void truncated(void)
+{
+	lua_Stream *s = stream_alloc();
+	stream_Iter it;
+	char big[300];
+	size_t i, size;
+	int cuts = 0;
+	memset(big, 'c', sizeof(big));
+	stream_put_int(s, 123456789);
+	stream_put_number(s, 0.1);
+	stream_put_string(s, big, sizeof(big));
+	size = stream_size(s);
+	for (i = 1; i < size; ++i)
+	{
+		int type;
+		stream_iter_init(&it, stream_ptr(s), i);
+		while ((type = stream_next(&it)) >= STREAM_TNIL)
+			;
+		if (type == STREAM_TERROR)
+		{
+			size_t pos = it.pos;
+			cuts += stream_next(&it) == STREAM_TERROR && it.pos == pos;
+		}
+		else
+			cuts += i == 5 || i == 14;
+	}
+	check(cuts == (int)size - 1);
+	stream_iter_init(&it, "\x0f", 1);
+	check(stream_next(&it) == STREAM_TERROR && it.pos == 0);
+	/* a length near SIZE_MAX is an error, not a position wrapping back */
+	memset(big, 0xff, 10);
+	big[0] = (char)0x86;
+	stream_iter_init(&it, big, 9);
+	check(stream_next(&it) == STREAM_TERROR && it.pos == 0);
+	big[0] = (char)0x8d;
+	stream_iter_init(&it, big, 10);
+	check(stream_next(&it) == STREAM_TERROR && it.pos == 0);
+	stream_free(s);
+}
+
+/* refs and ext values written from lua come through as their own items */
+static void refs_and_ext(lua_State *L)
+{
+	lua_Stream *s;
+	stream_Iter it;
+	check(luaL_dostring(L,
+		"local stream = require 'stream' "
+		"local mt = {__serialize = function(v) return v.raw end, __deserialize = function(raw) return {raw = raw} end} "
+		"stream.register(7, mt) "
+		"local t = {} "
+		"local s = stream.new() "
+		"s:write({t, t, setmetatable({raw = 'abc'}, mt)}) "
+		"return s") == 0);
+	s = stream_ref(L, -1);
+	stream_iter(s, &it);
+	check(stream_next(&it) == STREAM_TTABLE && stream_next(&it) == STREAM_TTABLE);
+	check(stream_next(&it) == STREAM_TDELIMITER && stream_next(&it) == STREAM_TEND);
+	check(stream_next(&it) == STREAM_TREF && it.ref == 1);
+	check(stream_next(&it) == STREAM_TEXT && it.ext == 7 && it.length == 3 && memcmp(it.string, "abc", 3) == 0);
+	check(stream_next(&it) == STREAM_TDELIMITER && stream_next(&it) == STREAM_TEND && stream_next(&it) == STREAM_TNONE);
+	stream_unref(L, s);
+	lua_pop(L, 1);
+}
+
+int main(void)
+{
+	lua_State *L = luaL_newstate();
+	luaL_openlibs(L);
+	lua_getglobal(L, "package");
+	lua_getfield(L, -1, "preload");
+	lua_pushcfunction(L, luaopen_stream);
+	lua_setfield(L, -2, "stream");
+	lua_pop(L, 2);
+	lua_getglobal(L, "require");
+	lua_pushstring(L, "stream");
+	lua_call(L, 1, 0);
+
+	roundtrip(L);
+	printf("------\n");
+	truncated();
+	printf("------\n");
+	refs_and_ext(L);
+
+	lua_close(L);
+	return failed;
+}
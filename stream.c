@@ -5,9 +5,47 @@
 #include <malloc.h>
 #include <stdlib.h>
 #include <limits.h>
+#include <math.h>
+#include <stdint.h>
+#include <errno.h>
+
+#ifndef _WIN32
+#define STREAM_FDIO
+#define STREAM_LOG
+#define STREAM_THREADS
+#include <unistd.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifndef IOV_MAX
+#define IOV_MAX		1024
+#endif
+#endif
+
+#ifdef __linux__
+#define STREAM_SHM
+#include <fcntl.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+
+#ifdef __F16C__
+#include <immintrin.h>
+#endif
 
 #include "buffer.h"
 #include "stream.h"
+#ifdef STREAM_THREADS
+#include "lualib.h"
+#endif
 
 #ifndef MIN
 #define MIN(x, y) ((x) < (y) ? x : y)
@@ -20,15 +58,36 @@
 #define luaL_register(L,n,f)	luaL_newlib(L,f)
 #endif
 
+#if (LUA_VERSION_NUM < 502)
+#define lua_rawlen(L,i)			lua_objlen(L,i)
+#endif
+
+#if (LUA_VERSION_NUM < 503)
+#define LUA_MAXINTEGER		PTRDIFF_MAX
+#define LUA_MININTEGER		PTRDIFF_MIN
+#endif
+
 #define luaL_check(c, ...)		if (!(c)) luaL_error(L, __VA_ARGS__)
 
 #define AUTHORS 	"Peter.Q"
 #define VERSION		"LuaStream 1.0"
 #define RELEASE		"LuaStream 1.0.1"
 
-#define REFS_SIZE	256
 #define BUFF_SIZE	256
+#define COMPACT_MIN	BUFF_SIZE
+#define DEPTH_MAX	1000
+#define FRAMES_SIZE	32
+#define EACH_BATCH	64
+#define PACK_CHUNK	64
 #define LUA_STREAM	"stream*"
+#define LUA_RING	"stream.shm*"
+#define LUA_CHAIN	"stream.chain*"
+#define LUA_LOG		"stream.log*"
+#define LUA_FROZEN	"stream.frozen"
+#define LUA_TYPES	"stream.types"
+#define LUA_HOOKS	"stream.hooks"
+#define LUA_MAXDEPTH	"stream.maxdepth"
+#define EXT_TYPES	256
 #define DEF_ENDIAN	1
 
 #define F_SIGNED_BYTE		'b'
@@ -41,10 +100,19 @@
 #define F_ZSTRING			'z'
 #define F_STRING			's'
 #define F_OBJECT			'o'
+#define F_HALF				'h'
+#define F_QUANTIZED			'q'
+#define F_BULK				'*'
+#define F_UNSIGNED_BITS		'u'
+#define F_SIGNED_BITS		'i'
+#define F_BIT				'?'
+#define F_ISBITS(c)			((c) == F_UNSIGNED_BITS || (c) == F_SIGNED_BITS || (c) == F_BIT)
 
 struct lua_Stream {
 	int ref;
+	int compact;
 	size_t pos;
+	size_t valid;
 	buffer_t buf;
 };
 
@@ -65,28 +133,101 @@ enum {
 	OP_TABLE_REF,
 	OP_TABLE_DELIMITER,
 	OP_TABLE_END,
+	OP_PATCH,
+	OP_REMOVE,
+	OP_EXT,
+	OP_FIXINT,
+	OP_FIXSTR,
+	OP_BAD,
+};
+
+/* immediate opcodes, the value or the string length is carried by the opcode byte itself */
+#define FIXINT_BASE		0x90
+#define FIXINT_COUNT	80
+#define FIXSTR_BASE		0xe0
+#define FIXSTR_COUNT	32
+
+#define OPS_ROW \
+	OP_NIL, OP_TRUE, OP_FALSE, OP_ZERO, OP_FLOAT, OP_INT, OP_STRING, OP_TABLE, \
+	OP_TABLE_REF, OP_TABLE_DELIMITER, OP_TABLE_END, OP_PATCH, OP_REMOVE, OP_EXT, OP_BAD, OP_BAD
+#define FIX_ROW(op) op, op, op, op, op, op, op, op, op, op, op, op, op, op, op, op
+
+/* opcode byte -> decoder entry, low nibble is the op and high nibble its length below 0x90 */
+static const unsigned char opcodes[256] = {
+	OPS_ROW, OPS_ROW, OPS_ROW, OPS_ROW, OPS_ROW, OPS_ROW, OPS_ROW, OPS_ROW, OPS_ROW,
+	FIX_ROW(OP_FIXINT), FIX_ROW(OP_FIXINT), FIX_ROW(OP_FIXINT), FIX_ROW(OP_FIXINT), FIX_ROW(OP_FIXINT),
+	FIX_ROW(OP_FIXSTR), FIX_ROW(OP_FIXSTR),
 };
 
+#ifdef STREAM_STATS
+static const char *const opnames[] = {
+	"nil", "true", "false", "zero", "float", "int", "string", "table",
+	"table_ref", "table_delimiter", "table_end", "patch", "remove", "ext", "fixint", "fixstr", "bad",
+};
+
+static STATS_TLS struct {
+	size_t encoded[OP_BAD + 1];
+	size_t decoded[OP_BAD + 1];
+	size_t refs_total;
+	size_t refs_max;
+} stream_stats;
+#endif
+
+/* refs live in a lua table at slot, created with the first table: table -> offset */
 struct writer_t {
-	struct {
-		const void* ptr;
-		size_t pos;
-	} refs[REFS_SIZE];
-	
 	size_t pos;
 	size_t count;
+	int slot;
+	int frozen;
 };
 
+/* offset -> table */
 struct reader_t {
-	struct {
-		size_t idx;
-		size_t pos;
-	} refs[REFS_SIZE];
-	
 	size_t pos;
 	size_t count;
+	int slot;
+	int trusted;
 };
 
+/* reserves the refs slot on top of the stack */
+static void writer_init(lua_State *L, struct writer_t *W, size_t pos)
+{
+	/* frozen tables are per state, looked up once per write rather than per table */
+	lua_getfield(L, LUA_REGISTRYINDEX, LUA_FROZEN);
+	W->frozen = !lua_isnil(L, -1);
+	lua_pop(L, 1);
+	lua_pushnil(L);
+	W->slot = lua_gettop(L);
+	W->pos = pos;
+	W->count = 0;
+}
+
+/* drops the refs registered from offset on, after their bytes were taken back */
+static void writer_forget(lua_State *L, struct writer_t *W, size_t offset)
+{
+	lua_pushnil(L);
+	while (lua_next(L, W->slot))
+	{
+		size_t where = (size_t)lua_tonumber(L, -1);
+		lua_pop(L, 1);
+		if (where >= offset)
+		{
+			lua_pushvalue(L, -1);
+			lua_pushnil(L);
+			lua_rawset(L, W->slot);
+		}
+	}
+}
+
+static void reader_init(lua_State *L, struct reader_t *R, size_t pos)
+{
+	lua_pushnil(L);
+	R->slot = lua_gettop(L);
+	R->pos = pos;
+	R->count = 0;
+	R->trusted = 0;
+}
+
 static void correctbytes (void *data, int size)
 {
 	if (native.endian != DEF_ENDIAN)
@@ -115,6 +256,8 @@ static size_t buffer_writeint(buffer_t *buf, lua_Integer n)
 static size_t buffer_writefloat(buffer_t *buf, lua_Number n)
 {
 	float f = n;
+	if (n == 0 && !signbit(n))
+		return 0;
 	if (n == (lua_Number)f)
 	{
 		correctbytes(&f, sizeof(f));
@@ -126,9 +269,306 @@ static size_t buffer_writefloat(buffer_t *buf, lua_Number n)
 	return sizeof(n);
 }
 
-static int buffer_writeobject(lua_State *L, buffer_t *buf, int idx, struct writer_t *W)
+static void buffer_writeinteger(buffer_t *buf, lua_Integer n)
 {
-	int top = lua_gettop(L);
+	size_t size, pos;
+	if (n >= 0 && n < FIXINT_COUNT)
+	{
+		buffer_writebyte(buf, FIXINT_BASE + n);
+		return;
+	}
+	pos = buffer_tell(buf);
+	buffer_writebyte(buf, OP_INT);
+	size = buffer_writeint(buf, n);
+	*buffer_at(buf, pos) |= size << 4;
+}
+
+/* offsets below 256 keep the single byte form with an empty length nibble */
+static void buffer_writeref(buffer_t *buf, size_t where)
+{
+	size_t size, pos;
+	if (where < 256)
+	{
+		buffer_writebyte(buf, OP_TABLE_REF);
+		buffer_writebyte(buf, (char)where);
+		return;
+	}
+	pos = buffer_tell(buf);
+	buffer_writebyte(buf, OP_TABLE_REF);
+	size = buffer_writeint(buf, (lua_Integer)where);
+	*buffer_at(buf, pos) |= size << 4;
+}
+
+static void buffer_writenumber(buffer_t *buf, lua_Number n)
+{
+	size_t size, pos = buffer_tell(buf);
+	buffer_writebyte(buf, OP_FLOAT);
+	size = buffer_writefloat(buf, n);
+	*buffer_at(buf, pos) |= size << 4;
+}
+
+static void buffer_writestring(buffer_t *buf, const char *str, size_t len)
+{
+	if (len < FIXSTR_COUNT)
+		buffer_writebyte(buf, FIXSTR_BASE + len);
+	else
+	{
+		size_t size, pos = buffer_tell(buf);
+		buffer_writebyte(buf, OP_STRING);
+		size = buffer_writeint(buf, len);
+		*buffer_at(buf, pos) |= size << 4;
+	}
+	buffer_write(buf, str, len);
+}
+
+/* integers keep their subtype on 5.3+, older versions store integral numbers as OP_INT */
+static void buffer_writenumeric(lua_State *L, buffer_t *buf, int idx)
+{
+#if (LUA_VERSION_NUM >= 503)
+	if (lua_isinteger(L, idx))
+		buffer_writeinteger(buf, lua_tointeger(L, idx));
+	else
+		buffer_writenumber(buf, lua_tonumber(L, idx));
+#else
+	lua_Number n = lua_tonumber(L, idx);
+	if (n >= (lua_Number)LUA_MININTEGER && n < (lua_Number)LUA_MAXINTEGER && (lua_Number)(lua_Integer)n == n)
+		buffer_writeinteger(buf, (lua_Integer)n);
+	else
+		buffer_writenumber(buf, n);
+#endif
+}
+
+struct ext_hook {
+	stream_Encoder encode;
+	stream_Decoder decode;
+};
+
+/* per state C callbacks, indexed by ext type id */
+static struct ext_hook *ext_hooks(lua_State *L)
+{
+	struct ext_hook *hooks;
+	lua_getfield(L, LUA_REGISTRYINDEX, LUA_HOOKS);
+	hooks = (struct ext_hook *)lua_touserdata(L, -1);
+	lua_pop(L, 1);
+	if (!hooks)
+	{
+		hooks = (struct ext_hook *)lua_newuserdata(L, sizeof(struct ext_hook) * EXT_TYPES);
+		memset(hooks, 0, sizeof(struct ext_hook) * EXT_TYPES);
+		lua_setfield(L, LUA_REGISTRYINDEX, LUA_HOOKS);
+	}
+	return hooks;
+}
+
+/* maps metatable mt <-> type id, callbacks may be NULL for __serialize/__deserialize */
+static void ext_register(lua_State *L, int type, int mt, stream_Encoder encoder, stream_Decoder decoder)
+{
+	struct ext_hook *hooks = ext_hooks(L);
+	luaL_check(type >= 0 && type < EXT_TYPES, "bad ext type %d", type);
+	lua_getfield(L, LUA_REGISTRYINDEX, LUA_TYPES);
+	if (!lua_istable(L, -1))
+	{
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, LUA_REGISTRYINDEX, LUA_TYPES);
+	}
+	lua_pushvalue(L, mt);
+	lua_pushnumber(L, type);
+	lua_rawset(L, -3);
+	lua_pushvalue(L, mt);
+	lua_rawseti(L, -2, type);
+	lua_pop(L, 1);
+	hooks[type].encode = encoder;
+	hooks[type].decode = decoder;
+}
+
+static void buffer_writeextdata(buffer_t *buf, int type, const char *data, size_t len)
+{
+	size_t size, pos = buffer_tell(buf);
+	buffer_writebyte(buf, OP_EXT);
+	buffer_writebyte(buf, type);
+	size = buffer_writeint(buf, len);
+	*buffer_at(buf, pos) |= size << 4;
+	buffer_write(buf, data, len);
+}
+
+/* writes a value whose metatable is registered as an ext type, returns 0 when it is not */
+static int buffer_writeext(lua_State *L, buffer_t *buf, int idx)
+{
+	int type, top = lua_gettop(L);
+	size_t len;
+	const char *data;
+	if (!lua_getmetatable(L, idx))
+		return 0;
+	lua_getfield(L, LUA_REGISTRYINDEX, LUA_TYPES);
+	if (!lua_istable(L, -1))
+	{
+		lua_settop(L, top);
+		return 0;
+	}
+	lua_pushvalue(L, top + 1);
+	lua_rawget(L, -2);
+	if (!lua_isnumber(L, -1))
+	{
+		lua_settop(L, top);
+		return 0;
+	}
+	type = lua_tointeger(L, -1);
+	if (ext_hooks(L)[type].encode)
+		data = (const char *)ext_hooks(L)[type].encode(L, idx, &len);
+	else
+	{
+		lua_getfield(L, top + 1, "__serialize");
+		lua_pushvalue(L, idx);
+		lua_call(L, 1, 1);
+		data = lua_tolstring(L, -1, &len);
+		luaL_check(data, "__serialize must return a string");
+	}
+	buffer_writeextdata(buf, type, data, len);
+	lua_settop(L, top);
+	return 1;
+}
+
+static void buffer_readext(lua_State *L, int type, const char *data, size_t size)
+{
+	stream_Decoder decode = ext_hooks(L)[type].decode;
+	if (decode)
+	{
+		decode(L, data, size);
+		return;
+	}
+	lua_getfield(L, LUA_REGISTRYINDEX, LUA_TYPES);
+	if (lua_istable(L, -1))
+		lua_rawgeti(L, -1, type);
+	if (!lua_istable(L, -1))
+		luaL_error(L, "unknown ext type %d", type);
+	lua_getfield(L, -1, "__deserialize");
+	lua_pushlstring(L, data, size);
+	lua_call(L, 1, 1);
+	lua_replace(L, -3);
+	lua_pop(L, 1);
+}
+
+/*
+ * frozen entry of the table at idx: {blob, sub, offset, ...}, the blob being
+ * a flag byte telling whether it shares subtables, then the bytes, followed
+ * by every subtable inside with its offset in the bytes. pushes the entry
+ * and returns the blob, or returns NULL with nothing pushed
+ */
+static const char *frozen_get(lua_State *L, int idx, size_t *len)
+{
+	const char *blob = NULL;
+	lua_getfield(L, LUA_REGISTRYINDEX, LUA_FROZEN);
+	if (lua_istable(L, -1))
+	{
+		lua_pushvalue(L, idx);
+		lua_rawget(L, -2);
+		if (lua_istable(L, -1))
+		{
+			lua_replace(L, -2);
+			lua_rawgeti(L, -1, 1);
+			blob = lua_tolstring(L, -1, len);
+			lua_pop(L, 1);
+			return blob;
+		}
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 1);
+	return blob;
+}
+
+/* registers the subtables of the frozen entry at e from offset at, 0 if one was met before and the blob can't be used */
+static int frozen_claim(lua_State *L, int e, struct writer_t *W, size_t at)
+{
+	int i, n = (int)lua_rawlen(L, e);
+	for (i = 2; i < n; i += 2)
+	{
+		lua_rawgeti(L, e, i);
+		lua_rawget(L, W->slot);
+		if (!lua_isnil(L, -1))
+		{
+			lua_pop(L, 1);
+			return 0;
+		}
+		lua_pop(L, 1);
+	}
+	for (i = 2; i < n; i += 2)
+	{
+		lua_rawgeti(L, e, i);
+		lua_rawgeti(L, e, i + 1);
+		lua_pushnumber(L, (lua_Number)(at + (size_t)lua_tonumber(L, -1)));
+		lua_replace(L, -2);
+		lua_rawset(L, W->slot);
+		W->count++;
+	}
+	return 1;
+}
+
+/* nesting limit for encode, decode and validate, per lua state, see stream.maxdepth */
+static int state_maxdepth(lua_State *L)
+{
+	int depth;
+	lua_getfield(L, LUA_REGISTRYINDEX, LUA_MAXDEPTH);
+	depth = lua_isnumber(L, -1) ? (int)lua_tonumber(L, -1) : DEPTH_MAX;
+	lua_pop(L, 1);
+	return depth;
+}
+
+enum {
+	F_NEXT,
+	F_VALUE,
+	F_ARRAY,
+	F_KEY,
+};
+
+/* one table being walked: its stack index, phase and next array index */
+struct frame {
+	int idx;
+	int phase;
+	size_t i;
+};
+
+/* frame stack, starts in place and moves to a userdata held in slot when it outgrows it */
+struct frames {
+	struct frame *base;
+	int count;
+	int size;
+	int slot;
+	int max;
+	struct frame fixed[FRAMES_SIZE];
+};
+
+static void frames_init(lua_State *L, struct frames *F)
+{
+	lua_pushnil(L);
+	F->slot = lua_gettop(L);
+	F->base = F->fixed;
+	F->max = state_maxdepth(L);
+	F->count = 0;
+	F->size = FRAMES_SIZE;
+}
+
+static struct frame *frames_push(lua_State *L, struct frames *F, int slots)
+{
+	luaL_check(F->count < F->max, "table too deep %d", F->max);
+	luaL_checkstack(L, slots + LUA_MINSTACK, "table too deep");
+	if (F->count == F->size)
+	{
+		struct frame *base = (struct frame *)lua_newuserdata(L, sizeof(struct frame) * F->size * 2);
+		memcpy(base, F->base, sizeof(struct frame) * F->count);
+		lua_replace(L, F->slot);
+		F->base = base;
+		F->size *= 2;
+	}
+	return &F->base[F->count++];
+}
+
+/* writes the value at idx, a table only gets its header and a frame to walk it, returns 1 then */
+static int buffer_writevalue(lua_State *L, buffer_t *buf, int idx, struct writer_t *W, struct frames *F)
+{
+#ifdef STREAM_STATS
+	size_t start = buffer_tell(buf);
+#endif
 	int type = lua_type(L, idx);
 	switch(type)
 	{
@@ -139,96 +579,145 @@ static int buffer_writeobject(lua_State *L, buffer_t *buf, int idx, struct write
 			buffer_writebyte(buf, lua_toboolean(L, idx) ? OP_TRUE : OP_FALSE);
 			break;
 		case LUA_TNUMBER:
-		{
-			lua_Number n = lua_tonumber(L, idx);
-			if (n == 0)
-				buffer_writebyte(buf, OP_ZERO);
-			else if (floor(n) == n)
-			{
-				size_t size, pos = buffer_tell(buf);
-				buffer_writebyte(buf, OP_INT);
-				size = buffer_writeint(buf, n);
-				*buffer_at(buf, pos) |= size << 4;
-			}
-			else
-			{
-				size_t size, pos = buffer_tell(buf);
-				buffer_writebyte(buf, OP_FLOAT);
-				size = buffer_writefloat(buf, n);
-				*buffer_at(buf, pos) |= size << 4;
-			}
+			buffer_writenumeric(L, buf, idx);
 			break;
-		}
 		case LUA_TSTRING:
 		{
 			size_t len;
 			const char* str = lua_tolstring(L, idx, &len);
-			size_t size, pos = buffer_tell(buf);
-			buffer_writebyte(buf, OP_STRING);
-			size = buffer_writeint(buf, len);
-			*buffer_at(buf, pos) |= size << 4;
-			buffer_write(buf, str, len);
+			buffer_writestring(buf, str, len);
 			break;
 		}
+		case LUA_TUSERDATA:
+			if (!buffer_writeext(L, buf, idx))
+				goto unexpected;
+			break;
 		case LUA_TTABLE:
 		{
-			const void *ptr = lua_topointer(L, idx);
-			size_t i;
-			for (i = 0; i < W->count; ++i)
+			struct frame *f;
+			if (buffer_writeext(L, buf, idx))
+				break;
+			if (W->count == 0)
 			{
-				if (W->refs[i].ptr == ptr)
-				{
-					buffer_writebyte(buf, OP_TABLE_REF);
-					buffer_writebyte(buf, W->refs[i].pos);
-					goto end;
-				}
+				lua_newtable(L);
+				lua_replace(L, W->slot);
 			}
-			luaL_check(W->count < REFS_SIZE, "table refs overflow %d", REFS_SIZE);
-			W->refs[W->count].ptr = ptr;
-			W->refs[W->count++].pos = buffer_tell(buf) - W->pos;
-			
-			buffer_writebyte(buf, OP_TABLE);
-			lua_pushnil(L);
-			i = 1;
-			while (lua_next(L, idx))
+			else
 			{
-				if (lua_isnumber(L, -2) && lua_tonumber(L, -2) == i++)
+				lua_pushvalue(L, idx);
+				lua_rawget(L, W->slot);
+				if (!lua_isnil(L, -1))
 				{
-					buffer_writeobject(L, buf, lua_gettop(L), W);
+					buffer_writeref(buf, (size_t)lua_tonumber(L, -1));
 					lua_pop(L, 1);
+					goto end;
 				}
-				else break;
+				lua_pop(L, 1);
 			}
-			buffer_writebyte(buf, OP_TABLE_DELIMITER);
-			if (lua_gettop(L) > top)
+			lua_pushvalue(L, idx);
+			lua_pushnumber(L, (lua_Number)(buffer_tell(buf) - W->pos));
+			lua_rawset(L, W->slot);
+			W->count++;
+			STAT(stream_stats.refs_total++);
+			STAT(stream_stats.refs_max = MAX(stream_stats.refs_max, W->count));
+			
+			if (W->frozen)
 			{
-				do
+				size_t len, at = buffer_tell(buf) - W->pos;
+				const char *blob = frozen_get(L, idx, &len);
+				if (blob)
 				{
-					buffer_writeobject(L, buf, lua_gettop(L) - 1, W);
-					buffer_writeobject(L, buf, lua_gettop(L), W);
+					/* refs inside the cached bytes only line up when it starts at the writer base */
+					int hit = (!blob[0] || at == 0) && frozen_claim(L, lua_gettop(L), W, at);
 					lua_pop(L, 1);
+					if (hit)
+					{
+						buffer_write(buf, blob + 1, len - 1);
+						goto end;
+					}
 				}
-				while (lua_next(L, idx));
 			}
-			buffer_writebyte(buf, OP_TABLE_END);
-			break;
+			buffer_writebyte(buf, OP_TABLE);
+			STAT(stream_stats.encoded[OP_TABLE]++);
+			f = frames_push(L, F, 4);
+			lua_pushvalue(L, idx);
+			lua_pushnil(L);
+			f->idx = lua_gettop(L) - 1;
+			f->phase = F_ARRAY;
+			f->i = 1;
+			return 1;
 		}
 		default:
-			lua_settop(L, top);
+		unexpected:
 			luaL_error(L, "unexpected type:%s", lua_typename(L, type));
 			return 0;
 	}
 end:
+	STAT(stream_stats.encoded[opcodes[(unsigned char)*buffer_at(buf, start)]]++);
+	return 0;
+}
+
+/*
+ * walks nested tables with an explicit frame stack, each table frame keeps
+ * the table at idx, the lua_next key at idx + 1 and the value at idx + 2
+ */
+static int buffer_writeobject(lua_State *L, buffer_t *buf, int idx, struct writer_t *W)
+{
+	struct frames F;
+	int top = lua_gettop(L);
+	if (lua_type(L, idx) != LUA_TTABLE)
+		return buffer_writevalue(L, buf, idx, W, NULL), 1;
+	frames_init(L, &F);
+	buffer_writevalue(L, buf, idx, W, &F);
+	while (F.count > 0)
+	{
+		struct frame *f = &F.base[F.count - 1];
+		int t = f->idx;
+		if (f->phase == F_VALUE)
+		{
+			f->phase = F_NEXT;
+			buffer_writevalue(L, buf, t + 2, W, &F);
+			continue;
+		}
+		lua_settop(L, t + 1);
+		if (!lua_next(L, t))
+		{
+			if (f->phase == F_ARRAY)
+				buffer_writebyte(buf, OP_TABLE_DELIMITER);
+			buffer_writebyte(buf, OP_TABLE_END);
+			F.count--;
+			lua_settop(L, t - 1);
+			continue;
+		}
+		if (f->phase == F_ARRAY)
+		{
+			if (lua_type(L, t + 1) == LUA_TNUMBER && lua_tonumber(L, t + 1) == f->i)
+			{
+				f->i++;
+				buffer_writevalue(L, buf, t + 2, W, &F);
+				continue;
+			}
+			buffer_writebyte(buf, OP_TABLE_DELIMITER);
+		}
+		f->phase = F_VALUE;
+		buffer_writevalue(L, buf, t + 1, W, &F);
+	}
 	lua_settop(L, top);
 	return 1;
 }
 
-static int buffer_readobject(lua_State *L, const char *data, size_t pos, size_t size, struct reader_t *R)
+/* bounds checks, skipped for data already proven by buffer_validate */
+#define readcheck(c, ...)		if (!R->trusted) luaL_check(c, __VA_ARGS__)
+
+/* reads the value at *pos, a table is pushed empty with a frame to fill it, returns 1 then */
+static int buffer_readvalue(lua_State *L, const char *data, size_t *at, size_t size, struct reader_t *R, struct frames *F)
 {
 	int op;
-	luaL_check(pos < size, "readobject overflow");
-	op = data[pos++];
-	switch(op & 0x0f)
+	size_t pos = *at;
+	readcheck(pos < size, "readobject overflow");
+	op = (unsigned char)data[pos++];
+	STAT(stream_stats.decoded[opcodes[op]]++);
+	switch(opcodes[op])
 	{
 		case OP_NIL:
 			lua_pushnil(L);
@@ -240,24 +729,37 @@ static int buffer_readobject(lua_State *L, const char *data, size_t pos, size_t
 			lua_pushboolean(L, 0);
 			break;
 		case OP_ZERO:
-			lua_pushnumber(L, 0);
+			lua_pushinteger(L, 0);
+			break;
+		case OP_FIXINT:
+			lua_pushinteger(L, op - FIXINT_BASE);
+			break;
+		case OP_FIXSTR:
+		{
+			size_t n = op - FIXSTR_BASE;
+			readcheck(n <= size - pos, "read string overflow");
+			lua_pushlstring(L, data + pos, n);
+			pos += n;
 			break;
+		}
 		case OP_INT:
 		{
 			int len = (op & 0xf0) >> 4;
 			lua_Integer n = 0;
-			luaL_check(pos + len <= size, "read int overflow");
+			readcheck(len <= sizeof(n) && len <= size - pos, "read int overflow");
 			memcpy(&n, data + pos, len);
-			correctbytes(&n, len);
-			lua_pushnumber(L, n);
+			correctbytes(&n, sizeof(n));
+			lua_pushinteger(L, n);
 			pos += len;
 			break;
 		}
 		case OP_FLOAT:
 		{
 			int len = (op & 0xf0) >> 4;
-			luaL_check(pos + len <= size, "read float or double overflow");
-			if (len == sizeof(float))
+			readcheck(len <= size - pos, "read float or double overflow");
+			if (len == 0)
+				lua_pushnumber(L, 0);
+			else if (len == sizeof(float))
 			{
 				float n = 0;
 				memcpy(&n, data + pos, len);
@@ -267,6 +769,7 @@ static int buffer_readobject(lua_State *L, const char *data, size_t pos, size_t
 			else
 			{
 				double n = 0;
+				readcheck(len == sizeof(n), "bad float size: %d", len);
 				memcpy(&n, data + pos, len);
 				correctbytes(&n, len);
 				lua_pushnumber(L, n);
@@ -278,600 +781,2480 @@ static int buffer_readobject(lua_State *L, const char *data, size_t pos, size_t
 		{
 			int len = (op & 0xf0) >> 4;
 			size_t n = 0;
-			luaL_check(pos + len <= size, "read string overflow");
+			readcheck(len <= sizeof(n) && len <= size - pos, "read string overflow");
 			memcpy(&n, data + pos, len);
-			correctbytes(&n, len);
+			correctbytes(&n, sizeof(n));
 			pos += len;
-			luaL_check(pos + n <= size, "read string overflow");
+			readcheck(n <= size - pos, "read string overflow");
 			lua_pushlstring(L, data + pos, n);
 			pos += n;
 			break;
 		}
 		case OP_TABLE:
 		{
-			size_t i;
+			struct frame *f = frames_push(L, F, 4);
 			lua_newtable(L);
-			lua_pushvalue(L, -1);
-			luaL_check(R->count < REFS_SIZE, "table refs overflow %d", REFS_SIZE);
-			R->refs[R->count].pos = pos - R->pos - 1;
-			R->refs[R->count++].idx = luaL_ref(L, LUA_REGISTRYINDEX);
-			for (i = 1; data[pos] != OP_TABLE_DELIMITER; ++i)
-			{
-				pos = buffer_readobject(L, data, pos, size, R);
-				lua_rawseti(L, -2, i);
-			}
-			pos++;
-			while (data[pos] != OP_TABLE_END)
+			if (R->count == 0)
 			{
-				pos = buffer_readobject(L, data, pos, size, R);
-				
-				pos = buffer_readobject(L, data, pos, size, R);
-				lua_settable(L, -3);
+				lua_newtable(L);
+				lua_replace(L, R->slot);
 			}
-			pos++;
+			lua_pushvalue(L, -1);
+			lua_rawseti(L, R->slot, (int)(pos - R->pos - 1));
+			R->count++;
+			STAT(stream_stats.refs_total++);
+			STAT(stream_stats.refs_max = MAX(stream_stats.refs_max, R->count));
+			f->idx = lua_gettop(L);
+			f->phase = F_ARRAY;
+			f->i = 1;
+			*at = pos;
+			return 1;
+		}
+		case OP_EXT:
+		{
+			int len = (op & 0xf0) >> 4, type;
+			size_t n = 0;
+			readcheck(len <= sizeof(n) && 1 + len <= size - pos, "read ext overflow");
+			type = (unsigned char)data[pos++];
+			memcpy(&n, data + pos, len);
+			correctbytes(&n, sizeof(n));
+			pos += len;
+			readcheck(n <= size - pos, "read ext overflow");
+			buffer_readext(L, type, data + pos, n);
+			pos += n;
 			break;
 		}
 		case OP_TABLE_REF:
 		{
-			size_t i, where = data[pos++];
-			for (i = 0; i < R->count; ++i)
+			int len = (op & 0xf0) >> 4;
+			size_t where = 0;
+			if (len == 0)
+			{
+				readcheck(pos < size, "read ref overflow");
+				where = (unsigned char)data[pos++];
+			}
+			else
 			{
-				if (R->refs[i].pos == where)
+				readcheck(len <= sizeof(where) && len <= size - pos, "read ref overflow");
+				memcpy(&where, data + pos, len);
+				correctbytes(&where, sizeof(where));
+				pos += len;
+			}
+			if (R->count > 0)
+			{
+				lua_rawgeti(L, R->slot, (int)where);
+				if (!lua_isnil(L, -1))
 				{
-					lua_rawgeti(L, LUA_REGISTRYINDEX, R->refs[i].idx);
-					return pos;
+					*at = pos;
+					return 0;
 				}
 			}
-			luaL_error(L, "bad ref: %d", where);
+			luaL_error(L, "bad ref: %d", (int)where);
 			return 0;
 		}
 		default:
 			luaL_error(L, "bad opecode: %d", op);
 			return 0;
 	}
-	return pos;
+	*at = pos;
+	return 0;
 }
 
-static int luastream_new (lua_State *L)
+/*
+ * fills nested tables with an explicit frame stack, each table frame keeps
+ * the table at idx and, between a key and its value, the key at idx + 1
+ */
+static int buffer_readobject(lua_State *L, const char *data, size_t pos, size_t size, struct reader_t *R)
 {
-	const char *buf;
-	int len;
-	buf = luaL_optlstring(L, 1, NULL, &len);
-	
-	lua_Stream *self = (lua_Stream *)lua_newuserdata(L, sizeof(lua_Stream));
-	self->buf = buffer_new(BUFF_SIZE);
-	self->pos = 0;
-	self->ref = LUA_REFNIL;
-	luaL_getmetatable(L, LUA_STREAM);
-	lua_setmetatable(L, -2);
-	if (buf)
-		buffer_write(self->buf, buf, len);
-	return 1;
+	struct frames F;
+	luaL_checkstack(L, LUA_MINSTACK, "readobject");
+	readcheck(pos < size, "readobject overflow");
+	if (opcodes[(unsigned char)data[pos]] != OP_TABLE)
+		return buffer_readvalue(L, data, &pos, size, R, NULL), pos;
+	frames_init(L, &F);
+	buffer_readvalue(L, data, &pos, size, R, &F);
+	while (F.count > 0)
+	{
+		struct frame *f = &F.base[F.count - 1];
+		readcheck(pos < size, "read table overflow");
+		if (f->phase == F_ARRAY && data[pos] == OP_TABLE_DELIMITER)
+		{
+			pos++;
+			f->phase = F_KEY;
+			continue;
+		}
+		if (f->phase == F_KEY && data[pos] == OP_TABLE_END)
+		{
+			pos++;
+			F.count--;
+		}
+		else if (buffer_readvalue(L, data, &pos, size, R, &F))
+			continue;
+		/* hand the value on top to the table that holds it */
+		if (F.count == 0)
+			break;
+		f = &F.base[F.count - 1];
+		switch (f->phase)
+		{
+			case F_ARRAY:
+				lua_rawseti(L, f->idx, f->i++);
+				break;
+			case F_KEY:
+				f->phase = F_VALUE;
+				break;
+			case F_VALUE:
+				lua_settable(L, f->idx);
+				f->phase = F_KEY;
+				break;
+		}
+	}
+	lua_replace(L, F.slot);
+	return pos;
 }
 
-static int luastream_clone (lua_State *L)
+#undef readcheck
+
+enum {
+	V_ARRAY,
+	V_KEY,
+	V_VALUE,
+};
+
+/* proves the whole values from pos on are well formed, returns the end of the last one */
+static size_t buffer_validate(const char *data, size_t pos, size_t size, int maxdepth)
 {
-	lua_Stream *self = (lua_Stream *)luaL_checkudata(L, 1, LUA_STREAM);
-	lua_Stream *other = (lua_Stream *)lua_newuserdata(L, sizeof(lua_Stream));
-	luaL_check(self->buf, "%s (released) #1", LUA_STREAM);
-	other->buf = buffer_new(buffer_tell(&self->buf));
-	other->pos = self->pos;
-	other->ref = LUA_REFNIL;
-	buffer_write(&other->buf, buffer_ptr(&self->buf), buffer_tell(&self->buf));
-	luaL_getmetatable(L, LUA_STREAM);
-	lua_setmetatable(L, -2);
-	return 1;
+	stream_Iter it;
+	unsigned char fixed[DEPTH_MAX];
+	unsigned char *state = maxdepth <= DEPTH_MAX ? fixed : (unsigned char *)malloc(maxdepth);
+	unsigned char *tables = NULL;
+	size_t base = pos, end = pos;
+	int depth = 0;
+	stream_iter_init(&it, data, size);
+	it.pos = pos;
+	for (;;)
+	{
+		size_t at = it.pos;
+		int type = stream_next(&it);
+		if (type == STREAM_TNONE || type == STREAM_TERROR)
+			break;
+		if (depth == 0)
+			base = at;
+		switch (type)
+		{
+			case STREAM_TTABLE:
+				if (depth == maxdepth)
+					goto done;
+				/* one bit per offset, refs only reach tables of their own value */
+				if (!tables && !(tables = (unsigned char *)calloc((size - pos) / 8 + 1, 1)))
+					goto done;
+				tables[(at - pos) >> 3] |= 1 << ((at - pos) & 7);
+				state[depth++] = V_ARRAY;
+				continue;
+			case STREAM_TDELIMITER:
+				if (depth == 0 || state[depth - 1] != V_ARRAY || data[at] != OP_TABLE_DELIMITER)
+					goto done;
+				state[depth - 1] = V_KEY;
+				continue;
+			case STREAM_TEND:
+				if (depth == 0 || state[depth - 1] != V_KEY || data[at] != OP_TABLE_END)
+					goto done;
+				depth--;
+				break;
+			case STREAM_TREF:
+				if (!tables || it.ref >= at - base || !(tables[(base - pos + it.ref) >> 3] & (1 << ((base - pos + it.ref) & 7))))
+					goto done;
+				break;
+		}
+		if (depth == 0)
+			end = it.pos;
+		else if (state[depth - 1] == V_KEY)
+			state[depth - 1] = V_VALUE;
+		else if (state[depth - 1] == V_VALUE)
+			state[depth - 1] = V_KEY;
+	}
+done:
+	if (state != fixed)
+		free(state);
+	free(tables);
+	return end;
 }
 
-static int luastream_extract (lua_State *L)
+/* writes the changes turning table oidx into table nidx, returns 0 when there are none */
+static int buffer_writepatch(lua_State *L, buffer_t *buf, int oidx, int nidx, int seen, struct writer_t *W, int left)
 {
-	lua_Stream *self, *other;
-	int index = 1;
-	size_t pos, total, size;
-	self = (lua_Stream *)luaL_checkudata(L, index, LUA_STREAM);
-	luaL_check(self->buf, "%s (released) #1", LUA_STREAM);
-	if (lua_isnumber(L, index))
-		pos = lua_tonumber(L, ++index);
-	else
-		pos = buffer_tell(&self->buf);
-	other = (lua_Stream *)luaL_checkudata(L, ++index, LUA_STREAM);
-	luaL_check(pos <= buffer_tell(&self->buf), "out of range #2");
-	luaL_check(other->buf, "%s (released) #%d", LUA_STREAM, index);
-	total = buffer_tell(&other->buf);
-	size = luaL_optint(L, ++index, total > other->pos ? total - other->pos : 0);
-	luaL_check(other->pos + size <= total, "size overflow #%d", index);
-	if (size)
-		buffer_insert(&self->buf, pos, buffer_at(&other->buf, other->pos), size);
-	other->pos += size;
-	lua_pushnumber(L, pos);
-	lua_pushnumber(L, pos + size);
-	return 2;
+	size_t start = buffer_tell(buf);
+	int top = lua_gettop(L);
+	/* left counts down from stream.maxdepth, patches nest on the C stack */
+	luaL_check(left > 0, "patch too deep");
+	luaL_checkstack(L, LUA_MINSTACK, "patch too deep");
+	lua_pushvalue(L, nidx);
+	lua_pushboolean(L, 1);
+	lua_rawset(L, seen);
+	buffer_writebyte(buf, OP_PATCH);
+	lua_pushnil(L);
+	while (lua_next(L, nidx))
+	{
+		lua_pushvalue(L, top + 1);
+		lua_rawget(L, oidx);
+		if (!lua_rawequal(L, top + 2, top + 3))
+		{
+			size_t mark = buffer_tell(buf), count = W->count;
+			buffer_writeobject(L, buf, top + 1, W);
+			lua_pushvalue(L, top + 2);
+			lua_rawget(L, seen);
+			if (lua_istable(L, top + 2) && lua_istable(L, top + 3) && !lua_toboolean(L, -1))
+			{
+				if (!buffer_writepatch(L, buf, top + 3, top + 2, seen, W, left - 1))
+				{
+					buffer_remove(buf, mark, buffer_tell(buf) - mark);
+					if (W->count != count)
+						writer_forget(L, W, mark - W->pos);
+					W->count = count;
+				}
+			}
+			else
+				buffer_writeobject(L, buf, top + 2, W);
+		}
+		lua_settop(L, top + 1);
+	}
+	lua_pushnil(L);
+	while (lua_next(L, oidx))
+	{
+		lua_pushvalue(L, top + 1);
+		lua_rawget(L, nidx);
+		if (lua_isnil(L, -1))
+		{
+			buffer_writeobject(L, buf, top + 1, W);
+			buffer_writebyte(buf, OP_REMOVE);
+		}
+		lua_settop(L, top + 1);
+	}
+	buffer_writebyte(buf, OP_TABLE_END);
+	lua_settop(L, top);
+	return buffer_tell(buf) - start > 2;
 }
 
-static int luastream_copy (lua_State *L)
+/* applies the patch at pos to table tidx */
+static size_t buffer_readpatch(lua_State *L, const char *data, size_t pos, size_t size, struct reader_t *R, int tidx, int left)
 {
-	lua_Stream *self, *other;
-	int index = 1;
-	size_t pos, total, size;
-	self = (lua_Stream *)luaL_checkudata(L, index, LUA_STREAM);
-	luaL_check(self->buf, "%s (released) #1", LUA_STREAM);
-	if (lua_isnumber(L, index))
-		pos = lua_tonumber(L, ++index);
-	else
-		pos = buffer_tell(&self->buf);
-	other = (lua_Stream *)luaL_checkudata(L, ++index, LUA_STREAM);
-	luaL_check(pos <= buffer_tell(&self->buf), "out of range #2");
-	luaL_check(other->buf, "%s (released) #%d", LUA_STREAM, index);
-	total = buffer_tell(&other->buf);
-	size = luaL_optint(L, ++index, total > other->pos ? total - other->pos : 0);
-	luaL_check(other->pos + size <= total, "size overflow #%d", index);
-	if (size)
-		buffer_insert(&self->buf, pos, buffer_at(&other->buf, other->pos), size);
-	lua_pushnumber(L, pos);
-	lua_pushnumber(L, pos + size);
-	return 2;
+	luaL_check(left > 0, "patch too deep");
+	luaL_checkstack(L, LUA_MINSTACK, "patch too deep");
+	luaL_check(pos < size && opcodes[(unsigned char)data[pos]] == OP_PATCH, "bad patch");
+	for (++pos; ; )
+	{
+		int op;
+		luaL_check(pos < size, "read patch overflow");
+		if (opcodes[(unsigned char)data[pos]] == OP_TABLE_END)
+			break;
+		pos = buffer_readobject(L, data, pos, size, R);
+		luaL_check(pos < size, "read patch overflow");
+		op = opcodes[(unsigned char)data[pos]];
+		if (op == OP_REMOVE)
+		{
+			pos++;
+			lua_pushnil(L);
+			lua_rawset(L, tidx);
+		}
+		else if (op == OP_PATCH)
+		{
+			lua_pushvalue(L, -1);
+			lua_rawget(L, tidx);
+			if (!lua_istable(L, -1))
+			{
+				lua_pop(L, 1);
+				lua_newtable(L);
+				lua_pushvalue(L, -2);
+				lua_pushvalue(L, -2);
+				lua_rawset(L, tidx);
+			}
+			pos = buffer_readpatch(L, data, pos, size, R, lua_gettop(L), left - 1);
+			lua_pop(L, 2);
+		}
+		else
+		{
+			pos = buffer_readobject(L, data, pos, size, R);
+			lua_rawset(L, tidx);
+		}
+	}
+	return pos + 1;
 }
 
-static int luastream_release (lua_State *L)
-{
-	lua_Stream *self = (lua_Stream *)luaL_checkudata(L, 1, LUA_STREAM);
-	if (self->buf)
-		buffer_delete(&self->buf);
-	return 0;
-}
+/*
+ * msgpack and json transcoding, straight from opcode bytes to the other format
+ * and back without building lua values. tables holding only array items map to
+ * arrays, anything else to maps/objects, with the array items keyed 1..n.
+ */
 
-static int luastream_mt_tostring (lua_State *L)
-{
-	lua_Stream *self = (lua_Stream *)luaL_checkudata(L, 1, LUA_STREAM);
-	if (self->buf)
-		lua_pushfstring(L, "%s (%p)", LUA_STREAM, self);
-	else
-		lua_pushfstring(L, "%s (released)", LUA_STREAM);
-	return 1;
-}
+enum {
+	T_ARRAY,
+	T_MAP,
+	T_MIXED,
+};
 
-static int luastream_tostring (lua_State *L)
+struct tframe {
+	size_t start;
+	size_t ret;
+	size_t n;
+	size_t h;
+	lua_Integer i;
+	int shape;
+	int hash;
+};
+
+/* doubles a frame array that starts out on the C stack, 0 when out of memory */
+static int tframes_grow(void *fixed, void **frames, size_t *cap, size_t size)
 {
-	lua_Stream *self = (lua_Stream *)luaL_checkudata(L, 1, LUA_STREAM);
-	if (self->buf)
-		lua_pushlstring(L, buffer_ptr(&self->buf), buffer_tell(&self->buf));
-	else
-		lua_pushnil(L);
+	void *other = malloc(*cap * 2 * size);
+	if (!other)
+		return 0;
+	memcpy(other, *frames, *cap * size);
+	if (*frames != fixed)
+		free(*frames);
+	*frames = other;
+	*cap *= 2;
 	return 1;
 }
 
-static int luastream_write (lua_State *L)
-{
-	size_t pos;
-	int i, top = lua_gettop(L);
-	struct writer_t W;
-	lua_Stream *self = (lua_Stream *)luaL_checkudata(L, 1, LUA_STREAM);
-	luaL_check(self->buf, "%s (released) #1", LUA_STREAM);
-	pos = buffer_tell(&self->buf);
-	W.count = 0;
-	W.pos = pos;
-	for (i = 2; i <= top; ++i, W.pos = buffer_tell(&self->buf))
-		buffer_writeobject(L, &self->buf, i, &W);
-	lua_pushnumber(L, pos);
-	lua_pushnumber(L, buffer_tell(&self->buf));
-	return 2;
-}
+struct tshape {
+	size_t start;
+	size_t narr;
+	size_t nhash;
+	int hash;
+};
 
-static int luastream_insert (lua_State *L)
+/*
+ * counts the array items and pairs of every table of the value at pos in one
+ * pass, in order of their OP_TABLE offsets; returns an error or NULL
+ */
+static const char *table_shapes(const char *data, size_t pos, size_t size, int maxdepth,
+	struct tshape *fixed, struct tshape **shapes, size_t *count)
 {
-	int i, top = lua_gettop(L);
-	struct writer_t W;
-	lua_Stream *self = (lua_Stream *)luaL_checkudata(L, 1, LUA_STREAM);
-	size_t size, pos = luaL_checkint(L, 2);
-	luaL_check(self->buf, "%s (released) #1", LUA_STREAM);
-	luaL_check(pos <= buffer_tell(&self->buf), "out of range #2");
-	W.count = 0;
-	if (pos < buffer_tell(&self->buf))
-	{
-		buffer_t buf = buffer_new(BUFF_SIZE);
-		for (i = 3, W.pos = 0; i <= top; ++i, W.pos = buffer_tell(&buf))
-			buffer_writeobject(L, &buf, i, &W);
-		size = buffer_tell(&buf);
-		buffer_insert(&self->buf, pos, buffer_ptr(&buf), size);
-		buffer_delete(&buf);
-	}
-	else
+	stream_Iter it;
+	size_t fixedopen[FRAMES_SIZE], *open = fixedopen;
+	size_t depth = 0, cap = FRAMES_SIZE, opencap = FRAMES_SIZE;
+	const char *err = NULL;
+	*shapes = fixed;
+	*count = 0;
+	stream_iter_init(&it, data, size);
+	it.pos = pos;
+	do
 	{
-		for (i = 3, W.pos = pos; i <= top; ++i, W.pos = buffer_tell(&self->buf))
-			buffer_writeobject(L, &self->buf, i, &W);
-		size = buffer_tell(&self->buf) - pos;
-	}
-	lua_pushnumber(L, pos);
-	lua_pushnumber(L, pos + size);
-	return 2;
+		size_t at = it.pos;
+		struct tshape *t = depth ? &(*shapes)[open[depth - 1]] : NULL;
+		int type = stream_next(&it);
+		if (type == STREAM_TNONE || type == STREAM_TERROR)
+		{
+			err = depth ? "bad or truncated table" : "bad or truncated value";
+			break;
+		}
+		if (type == STREAM_TDELIMITER)
+		{
+			if (!t || t->hash)
+			{
+				err = "misplaced table delimiter";
+				break;
+			}
+			t->hash = 1;
+			continue;
+		}
+		if (type == STREAM_TEND)
+		{
+			if (!t || !t->hash || t->nhash & 1)
+			{
+				err = "misplaced table end";
+				break;
+			}
+			t->nhash /= 2;
+			depth--;
+			continue;
+		}
+		if (t && t->hash)
+			t->nhash++;
+		else if (t)
+			t->narr++;
+		if (type == STREAM_TTABLE)
+		{
+			if (depth >= (size_t)maxdepth
+				|| (depth == opencap && !tframes_grow(fixedopen, (void **)&open, &opencap, sizeof(*open)))
+				|| (*count == cap && !tframes_grow(fixed, (void **)shapes, &cap, sizeof(**shapes))))
+			{
+				err = "table too deep";
+				break;
+			}
+			t = &(*shapes)[*count];
+			t->start = at;
+			t->narr = 0;
+			t->nhash = 0;
+			t->hash = 0;
+			open[depth++] = (*count)++;
+		}
+	} while (depth > 0);
+	if (open != fixedopen)
+		free(open);
+	if (err && *shapes != fixed)
+		free(*shapes);
+	return err;
 }
 
-static int luastream_read (lua_State *L)
+/* the shape of the table starting at start, shapes are sorted by offset */
+static struct tshape *table_shape(struct tshape *shapes, size_t count, size_t start)
 {
-	struct reader_t R;
-	lua_Stream *self = (lua_Stream *)luaL_checkudata(L, 1, LUA_STREAM);
-	size_t i, pos, nb = luaL_optint(L, 2, 1);
-	luaL_check(self->buf, "%s (released) #1", LUA_STREAM);
-	R.count = 0;
-	R.pos = self->pos;
-	for (i = 0; i < nb; ++i, R.pos = self->pos)
-		self->pos = buffer_readobject(L, buffer_ptr(&self->buf), self->pos, buffer_tell(&self->buf), &R);
-
-	for (i = 0; i < R.count; ++i)
-		luaL_unref(L, LUA_REGISTRYINDEX, R.refs[i].idx);
-	return nb;
+	size_t lo = 0, hi = count;
+	while (lo < hi)
+	{
+		size_t mid = lo + (hi - lo) / 2;
+		if (shapes[mid].start < start)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo < count && shapes[lo].start == start ? &shapes[lo] : NULL;
 }
 
-static int luastream_remove (lua_State *L)
+static void mp_write(buffer_t *out, unsigned char tag, uint64_t n, int bytes)
 {
-	int top = lua_gettop(L);
-	lua_Stream *self = (lua_Stream *)luaL_checkudata(L, 1, LUA_STREAM);
-	size_t pos, size;
-	luaL_check(self->buf, "%s (released) #1", LUA_STREAM);
-	pos = luaL_checkint(L, 2);
-	size = luaL_checkint(L, 3);
-	stream_remove(self, pos, size);
-	return 0;
+	char b[9];
+	int i;
+	b[0] = tag;
+	for (i = bytes; i > 0; --i, n >>= 8)
+		b[i] = (char)(n & 0xff);
+	buffer_write(out, b, bytes + 1);
 }
 
-static int luastream_seek (lua_State *L)
+static uint64_t mp_read(const unsigned char *p, int bytes)
 {
-	lua_Stream *self = (lua_Stream *)luaL_checkudata(L, 1, LUA_STREAM);
-	size_t pos = luaL_checkint(L, 2);
-	luaL_check(self->buf, "%s (released) #1", LUA_STREAM);
-	luaL_check(pos <= buffer_tell(&self->buf), "out of range #2");
-	self->pos = pos;
-	return 0;
+	uint64_t n = 0;
+	int i;
+	for (i = 0; i < bytes; ++i)
+		n = (n << 8) | p[i];
+	return n;
 }
 
-static int luastream_tell (lua_State *L)
+/* tag holds the fix form, tag16 the 16 bit one followed by the 32 bit one */
+static void mp_writelen(buffer_t *out, unsigned char tag, size_t fixmax, unsigned char tag16, size_t n)
 {
-	lua_Stream *self = (lua_Stream *)luaL_checkudata(L, 1, LUA_STREAM);
-	luaL_check(self->buf, "%s (released) #1", LUA_STREAM);
-	lua_pushnumber(L, self->pos);
-	return 1;
+	if (n <= fixmax)
+		buffer_writebyte(out, tag | (unsigned char)n);
+	else if (n <= 0xffff)
+		mp_write(out, tag16, n, 2);
+	else
+		mp_write(out, tag16 + 1, n, 4);
 }
 
-static int luastream_unread (lua_State *L)
+static void mp_writeinteger(buffer_t *out, lua_Integer n)
 {
-	lua_Stream *self = (lua_Stream *)luaL_checkudata(L, 1, LUA_STREAM);
-	luaL_check(self->buf, "%s (released) #1", LUA_STREAM);
-	lua_pushnumber(L, buffer_tell(&self->buf) - self->pos);
-	return 1;
+	if (n >= 0)
+	{
+		if (n < 0x80)
+			buffer_writebyte(out, (char)n);
+		else if (n <= 0xff)
+			mp_write(out, 0xcc, n, 1);
+		else if (n <= 0xffff)
+			mp_write(out, 0xcd, n, 2);
+		else if ((uint64_t)n <= 0xffffffffu)
+			mp_write(out, 0xce, n, 4);
+		else
+			mp_write(out, 0xcf, n, 8);
+	}
+	else if (n >= -32)
+		buffer_writebyte(out, (char)n);
+	else if (n >= -128)
+		mp_write(out, 0xd0, (uint64_t)n, 1);
+	else if (n >= -32768)
+		mp_write(out, 0xd1, (uint64_t)n, 2);
+	else if (n >= -2147483647 - 1)
+		mp_write(out, 0xd2, (uint64_t)n, 4);
+	else
+		mp_write(out, 0xd3, (uint64_t)n, 8);
 }
 
-static int luastream_size (lua_State *L)
+static void mp_writenumber(buffer_t *out, lua_Number n)
 {
-	lua_Stream *self = (lua_Stream *)luaL_checkudata(L, 1, LUA_STREAM);
-	luaL_check(self->buf, "%s (released) #1", LUA_STREAM);
-	lua_pushnumber(L, buffer_tell(&self->buf));
-	return 1;
+	float f = (float)n;
+	if ((lua_Number)f == n || n != n)
+	{
+		uint32_t u;
+		memcpy(&u, &f, sizeof(u));
+		mp_write(out, 0xca, u, 4);
+	}
+	else
+	{
+		double d = n;
+		uint64_t u;
+		memcpy(&u, &d, sizeof(u));
+		mp_write(out, 0xcb, u, 8);
+	}
 }
 
-static int luastream_empty (lua_State *L)
+static void mp_writestring(buffer_t *out, const char *str, size_t len)
 {
-	lua_Stream *self = (lua_Stream *)luaL_checkudata(L, 1, LUA_STREAM);
-	if (!self->buf)
-		lua_pushnil(L);
+	if (len < 32)
+		buffer_writebyte(out, (char)(0xa0 | len));
+	else if (len <= 0xff)
+		mp_write(out, 0xd9, len, 1);
 	else
-		lua_pushboolean(L, buffer_tell(&self->buf) == 0);
-	return 1;
+		mp_writelen(out, 0, 0, 0xda, len);
+	buffer_write(out, str, len);
 }
 
-static int luastream_eof (lua_State *L)
+static const char *mp_writeext(buffer_t *out, int type, const char *data, size_t len)
 {
-	lua_Stream *self = (lua_Stream *)luaL_checkudata(L, 1, LUA_STREAM);
-	luaL_check(self->buf, "%s (released) #1", LUA_STREAM);
-	lua_pushboolean(L, self->pos >= buffer_tell(&self->buf));
-	return 1;
+	if (type > 127)
+		return "ext type does not fit msgpack";
+	switch (len)
+	{
+		case 1: buffer_writebyte(out, (char)0xd4); break;
+		case 2: buffer_writebyte(out, (char)0xd5); break;
+		case 4: buffer_writebyte(out, (char)0xd6); break;
+		case 8: buffer_writebyte(out, (char)0xd7); break;
+		case 16: buffer_writebyte(out, (char)0xd8); break;
+		default:
+			if (len <= 0xff)
+				mp_write(out, 0xc7, len, 1);
+			else
+				mp_writelen(out, 0, 0, 0xc8, len);
+			break;
+	}
+	buffer_writebyte(out, (char)type);
+	buffer_write(out, data, len);
+	return NULL;
 }
 
-static const char *getnext(const char *f, const char *e)
+static void json_writestring(buffer_t *out, const char *str, size_t len)
 {
-	while(f < e && isdigit(*f)) ++f;
-	return f;
+	static const char hex[] = "0123456789abcdef";
+	size_t i, from = 0;
+	buffer_writebyte(out, '"');
+	for (i = 0; i < len; ++i)
+	{
+		unsigned char c = (unsigned char)str[i];
+		char esc[6] = {'\\', 0, '0', '0', 0, 0};
+		int n = 2;
+		if (c >= 0x20 && c != '"' && c != '\\')
+			continue;
+		switch (c)
+		{
+			case '"': esc[1] = '"'; break;
+			case '\\': esc[1] = '\\'; break;
+			case '\b': esc[1] = 'b'; break;
+			case '\f': esc[1] = 'f'; break;
+			case '\n': esc[1] = 'n'; break;
+			case '\r': esc[1] = 'r'; break;
+			case '\t': esc[1] = 't'; break;
+			default:
+				esc[1] = 'u';
+				esc[4] = hex[c >> 4];
+				esc[5] = hex[c & 15];
+				n = 6;
+				break;
+		}
+		buffer_write(out, str + from, i - from);
+		buffer_write(out, esc, n);
+		from = i + 1;
+	}
+	buffer_write(out, str + from, len - from);
+	buffer_writebyte(out, '"');
 }
 
-static size_t getsize(const char *f, const char *e)
+static const char *json_writenumber(buffer_t *out, stream_Iter *it, int quoted)
 {
-	if (f < e)
+	char num[48];
+	int len;
+	if (it->type == STREAM_TINTEGER)
+		len = sprintf(num, quoted ? "\"%lld\"" : "%lld", (long long)it->integer);
+	else
 	{
-		switch (*f)
+		if (it->number != it->number || it->number - it->number != 0)
+			return "cannot encode nan or inf as json";
+		len = sprintf(num, quoted ? "\"%.17g\"" : "%.17g", (double)it->number);
+		/* keeps floats floats when read back */
+		if (!quoted && !strpbrk(num, ".e"))
 		{
-			case 'b': case 'B':
-				return 1;
-			case 'w': case 'W':
-				return 2;
-			case 'd': case 'D':
-				return 4;
-			case 's':
-				return atoi(++f);
+			memcpy(num + len, ".0", 3);
+			len += 2;
 		}
 	}
-	return 0;
+	buffer_write(out, num, len);
+	return NULL;
 }
 
-static int luastream_writef (lua_State *L)
+/* transcodes the value at *at into msgpack or json, returns an error or NULL */
+static const char *stream_transcode(const char *data, size_t *at, size_t size, buffer_t *out, int json, int maxdepth)
 {
-	lua_Stream *self = (lua_Stream *)luaL_checkudata(L, 1, LUA_STREAM);
-	size_t len, pos, i = 2;
-	const char *f, *e;
-	f = luaL_checklstring(L, 2, &len);
-	e = f + len;
-	luaL_check(self->buf, "%s (released) #1", LUA_STREAM);
-	pos = buffer_tell(&self->buf);
-	for (; f < e; f = getnext(++f, e))
+	stream_Iter it;
+	struct tframe fixed[FRAMES_SIZE], *frames = fixed;
+	struct tshape fixedshapes[FRAMES_SIZE], *shapes, *shape;
+	size_t depth = 0, cap = FRAMES_SIZE, base = *at, nshapes;
+	const char *err;
+	/* one counting pass for every table, refs included, instead of one per table */
+	if ((err = table_shapes(data, *at, size, maxdepth, fixedshapes, &shapes, &nshapes)))
+		return err;
+	stream_iter_init(&it, data, size);
+	it.pos = *at;
+	do
 	{
-		switch(*f)
+		size_t pos = it.pos, ret = 0, i;
+		struct tframe *f = depth ? &frames[depth - 1] : NULL;
+		int type = stream_next(&it);
+		if (type == STREAM_TNONE || type == STREAM_TERROR)
 		{
-		case F_SIGNED_BYTE:
+			err = "bad or truncated value";
+			break;
+		}
+		if (type == STREAM_TDELIMITER)
+		{
+			if (!f || f->hash)
 			{
-				char n = luaL_checkinteger(L, ++i);
-				correctbytes(&n, sizeof(n));
-				buffer_write(&self->buf, &n, sizeof(n));
+				err = "misplaced table delimiter";
 				break;
 			}
-		case F_UNSIGNED_BYTE:
-			{
-				unsigned char n = luaL_checkinteger(L, ++i);
-				correctbytes(&n, sizeof(n));
-				buffer_write(&self->buf, &n, sizeof(n));
-				break;
-			}
-		case F_SIGNED_WORD:
+			f->hash = 1;
+			continue;
+		}
+		if (type == STREAM_TEND)
+		{
+			if (!f || !f->hash || f->h & 1)
 			{
-				short n = luaL_checkinteger(L, ++i);
-				correctbytes(&n, sizeof(n));
-				buffer_write(&self->buf, &n, sizeof(n));
+				err = "misplaced table end";
 				break;
 			}
-		case F_UNSIGNED_WORD:
+			if (json)
+				buffer_writebyte(out, f->shape == T_ARRAY ? ']' : '}');
+			if (f->ret)
+				it.pos = f->ret;
+			depth--;
+			continue;
+		}
+		if (f && f->hash)
+		{
+			/* a key */
+			if (!(f->h++ & 1) && json)
 			{
-				unsigned short n = luaL_checkinteger(L, ++i);
-				correctbytes(&n, sizeof(n));
-				buffer_write(&self->buf, &n, sizeof(n));
-				break;
+				if (f->n)
+					buffer_writebyte(out, ',');
+				if (type == STREAM_TSTRING)
+					json_writestring(out, it.string, it.length);
+				else if (type == STREAM_TINTEGER || type == STREAM_TNUMBER)
+				{
+					if ((err = json_writenumber(out, &it, 1)))
+						break;
+				}
+				else
+				{
+					err = "json keys must be strings or numbers";
+					break;
+				}
+				buffer_writebyte(out, ':');
+				f->n++;
+				continue;
 			}
-		case F_SIGNED_DWORD:
+		}
+		else if (f && !f->hash)
+		{
+			/* an array item */
+			if (json && f->n)
+				buffer_writebyte(out, ',');
+			if (f->shape == T_MIXED)
 			{
-				long n = luaL_checkinteger(L, ++i);
-				correctbytes(&n, sizeof(n));
-				buffer_write(&self->buf, &n, sizeof(n));
-				break;
+				if (json)
+				{
+					char key[32];
+					buffer_write(out, key, sprintf(key, "\"%lld\":", (long long)f->i));
+				}
+				else
+					mp_writeinteger(out, f->i);
+				f->i++;
 			}
-		case F_UNSIGNED_DWORD:
-			{
-				unsigned long n = luaL_checkinteger(L, ++i);
-				correctbytes(&n, sizeof(n));
-				buffer_write(&self->buf, &n, sizeof(n));
+		}
+		if (f)
+			f->n++;
+		switch (type)
+		{
+			case STREAM_TNIL:
+				if (json)
+					buffer_write(out, "null", 4);
+				else
+					buffer_writebyte(out, (char)0xc0);
 				break;
-			}
-		case F_FLOAT:
-			{
-				lua_Number n = luaL_checknumber(L, ++i);
-				correctbytes(&n, sizeof(n));
-				buffer_write(&self->buf, &n, sizeof(n));
+			case STREAM_TBOOLEAN:
+				if (json)
+					buffer_write(out, it.boolean ? "true" : "false", it.boolean ? 4 : 5);
+				else
+					buffer_writebyte(out, (char)(it.boolean ? 0xc3 : 0xc2));
 				break;
-			}
-		case F_ZSTRING:
-			{
-				const char *s = luaL_checklstring(L, ++i, &len);
-				size_t sz = getsize(f, e);
-				if (sz == 0) sz = len;
-				buffer_write(&self->buf, s, sz);
-				buffer_writebyte(&self->buf, 0);
+			case STREAM_TINTEGER:
+			case STREAM_TNUMBER:
+				if (json)
+					err = json_writenumber(out, &it, 0);
+				else if (type == STREAM_TINTEGER)
+					mp_writeinteger(out, it.integer);
+				else
+					mp_writenumber(out, it.number);
 				break;
-			}
-		case F_STRING:
-			{
-				const char *s = luaL_checklstring(L, ++i, &len);
-				size_t sz = getsize(f, e);
-				if (sz == 0) sz = len;
-				buffer_write(&self->buf, s, sz);
+			case STREAM_TSTRING:
+				if (json)
+					json_writestring(out, it.string, it.length);
+				else
+					mp_writestring(out, it.string, it.length);
 				break;
-			}
-		case F_OBJECT:
-			{
-				struct writer_t W;
-				W.count = 0;
-				W.pos = buffer_tell(&self->buf);
-				buffer_writeobject(L, &self->buf, ++i, &W);
+			case STREAM_TEXT:
+				err = json ? "ext values have no json form" : mp_writeext(out, it.ext, it.string, it.length);
+				break;
+			case STREAM_TREF:
+				/* transcode the target again, cycles can not be flattened */
+				ret = it.pos;
+				pos = base + it.ref;
+				if (pos >= ret || (unsigned char)data[pos] != OP_TABLE)
+				{
+					err = "bad ref";
+					break;
+				}
+				for (i = 0; i < depth; ++i)
+				{
+					if (frames[i].start == pos)
+						err = "cyclic table";
+				}
+				if (err)
+					break;
+				it.pos = pos;
+				stream_next(&it);
+				/* fall through */
+			case STREAM_TTABLE:
+				if (!(shape = table_shape(shapes, nshapes, pos)))
+				{
+					err = "bad or truncated table";
+					break;
+				}
+				if (depth >= (size_t)maxdepth || (depth == cap && !tframes_grow(fixed, (void **)&frames, &cap, sizeof(*frames))))
+				{
+					err = "table too deep";
+					break;
+				}
+				f = &frames[depth++];
+				f->start = pos;
+				f->ret = ret;
+				f->n = 0;
+				f->h = 0;
+				f->i = 1;
+				f->hash = 0;
+				f->shape = shape->nhash == 0 ? T_ARRAY : shape->narr == 0 ? T_MAP : T_MIXED;
+				if (json)
+					buffer_writebyte(out, f->shape == T_ARRAY ? '[' : '{');
+				else if (f->shape == T_ARRAY)
+					mp_writelen(out, 0x90, 15, 0xdc, shape->narr);
+				else
+					mp_writelen(out, 0x80, 15, 0xde, shape->narr + shape->nhash);
 				break;
-			}
-		default:
-			luaL_error(L, "unsupport format '%c'", *(--f));
-			break;
 		}
-	}
-	lua_pushnumber(L, pos);
-	lua_pushnumber(L, buffer_tell(&self->buf));
-	return 2;
+	} while (!err && depth > 0);
+	if (frames != fixed)
+		free(frames);
+	if (shapes != fixedshapes)
+		free(shapes);
+	if (!err)
+		*at = it.pos;
+	return err;
 }
 
-static int luastream_insertf (lua_State *L)
+/* parses msgpack values from *at to size into opcode bytes */
+static const char *stream_frommsgpack(const char *data, size_t *at, size_t size, buffer_t *out, int maxdepth)
 {
-	lua_Stream *self = (lua_Stream *)luaL_checkudata(L, 1, LUA_STREAM);
-	size_t len, where, i = 3, pos = luaL_checkint(L, 2);
-	const char *f, *e;
-	f = luaL_checklstring(L, 3, &len);
-	e = f + len;
-	luaL_check(self->buf, "%s (released) #1", LUA_STREAM);
-	luaL_check(pos <= buffer_tell(&self->buf), "out of range #2");
-	for (where = pos; f < e; f = getnext(++f, e))
+	struct pframe {
+		size_t left;
+		int map;
+	} fixed[FRAMES_SIZE], *frames = fixed;
+	const unsigned char *p = (const unsigned char *)data;
+	size_t depth = 0, cap = FRAMES_SIZE, pos = *at;
+	const char *err = NULL;
+	while (!err && (pos < size || depth > 0))
 	{
-		switch(*f)
+		size_t n = 0, len = 0;
+		int c, kind = 0, bytes = 0;
+		if (pos >= size)
 		{
-		case F_SIGNED_BYTE:
-			{
-				char n = luaL_checkinteger(L, ++i);
-				correctbytes(&n, sizeof(n));
-				buffer_insert(&self->buf, where, &n, sizeof(n));
-				where += sizeof(n);
-				break;
-			}
-		case F_UNSIGNED_BYTE:
-			{
-				unsigned char n = luaL_checkinteger(L, ++i);
-				correctbytes(&n, sizeof(n));
-				buffer_insert(&self->buf, where, &n, sizeof(n));
-				where += sizeof(n);
-				break;
-			}
-		case F_SIGNED_WORD:
-			{
-				short n = luaL_checkinteger(L, ++i);
-				correctbytes(&n, sizeof(n));
-				buffer_insert(&self->buf, where, &n, sizeof(n));
-				where += sizeof(n);
-				break;
-			}
-		case F_UNSIGNED_WORD:
-			{
-				unsigned short n = luaL_checkinteger(L, ++i);
-				correctbytes(&n, sizeof(n));
-				buffer_insert(&self->buf, where, &n, sizeof(n));
-				where += sizeof(n);
-				break;
-			}
-		case F_SIGNED_DWORD:
+			err = "truncated msgpack";
+			break;
+		}
+		c = p[pos++];
+		if (c <= 0x7f)
+			buffer_writeinteger(out, c);
+		else if (c >= 0xe0)
+			buffer_writeinteger(out, (signed char)c);
+		else if (c <= 0x8f)
+			kind = 'm', n = c & 0x0f;
+		else if (c <= 0x9f)
+			kind = 'a', n = c & 0x0f;
+		else if (c <= 0xbf)
+			kind = 's', len = c & 0x1f;
+		else
+		{
+			static const signed char sizes[32] = {
+				0, -1, 0, 0, 1, 2, 4, 1, 2, 4, 4, 8, 1, 2, 4, 8,
+				1, 2, 4, 8, 1, 2, 4, 8, 16, 1, 2, 4, 2, 4, 2, 4,
+			};
+			bytes = sizes[c - 0xc0];
+			if (bytes < 0 || pos + bytes > size)
 			{
-				long n = luaL_checkinteger(L, ++i);
-				correctbytes(&n, sizeof(n));
-				buffer_insert(&self->buf, where, &n, sizeof(n));
-				where += sizeof(n);
+				err = bytes < 0 ? "bad msgpack byte" : "truncated msgpack";
 				break;
 			}
-		case F_UNSIGNED_DWORD:
+			switch (c)
 			{
-				unsigned long n = luaL_checkinteger(L, ++i);
-				correctbytes(&n, sizeof(n));
-				buffer_insert(&self->buf, where, &n, sizeof(n));
-				where += sizeof(n);
-				break;
+				case 0xc0: buffer_writebyte(out, OP_NIL); break;
+				case 0xc2: buffer_writebyte(out, OP_FALSE); break;
+				case 0xc3: buffer_writebyte(out, OP_TRUE); break;
+				case 0xc4: case 0xc5: case 0xc6:
+				case 0xd9: case 0xda: case 0xdb:
+					kind = 's';
+					len = (size_t)mp_read(p + pos, bytes);
+					break;
+				case 0xc7: case 0xc8: case 0xc9:
+					kind = 'x';
+					len = (size_t)mp_read(p + pos, bytes);
+					break;
+				case 0xd4: case 0xd5: case 0xd6: case 0xd7: case 0xd8:
+					kind = 'x';
+					len = bytes;
+					bytes = 0;
+					break;
+				case 0xca:
+				{
+					uint32_t u = (uint32_t)mp_read(p + pos, 4);
+					float f;
+					memcpy(&f, &u, sizeof(f));
+					buffer_writenumber(out, f);
+					break;
+				}
+				case 0xcb:
+				{
+					uint64_t u = mp_read(p + pos, 8);
+					double d;
+					memcpy(&d, &u, sizeof(d));
+					buffer_writenumber(out, d);
+					break;
+				}
+				case 0xcc: case 0xcd: case 0xce: case 0xcf:
+				{
+					uint64_t u = mp_read(p + pos, bytes);
+					if (u > (uint64_t)LUA_MAXINTEGER)
+						buffer_writenumber(out, (lua_Number)u);
+					else
+						buffer_writeinteger(out, (lua_Integer)u);
+					break;
+				}
+				case 0xd0: case 0xd1: case 0xd2: case 0xd3:
+				{
+					int shift = 64 - bytes * 8;
+					int64_t v = (int64_t)(mp_read(p + pos, bytes) << shift) >> shift;
+					if (v < (int64_t)LUA_MININTEGER || v > (int64_t)LUA_MAXINTEGER)
+						buffer_writenumber(out, (lua_Number)v);
+					else
+						buffer_writeinteger(out, (lua_Integer)v);
+					break;
+				}
+				case 0xdc: case 0xdd:
+					kind = 'a';
+					n = (size_t)mp_read(p + pos, bytes);
+					break;
+				case 0xde: case 0xdf:
+					kind = 'm';
+					n = (size_t)mp_read(p + pos, bytes);
+					break;
 			}
-		case F_FLOAT:
+			pos += bytes;
+		}
+		if (kind == 's' || kind == 'x')
+		{
+			int type = 0;
+			if (kind == 'x')
 			{
-				lua_Number n = luaL_checknumber(L, ++i);
-				correctbytes(&n, sizeof(n));
-				buffer_insert(&self->buf, where, &n, sizeof(n));
-				where += sizeof(n);
-				break;
+				if (pos >= size || (signed char)p[pos] < 0)
+				{
+					err = pos >= size ? "truncated msgpack" : "unsupported msgpack ext type";
+					break;
+				}
+				type = p[pos++];
 			}
-		case F_ZSTRING:
+			if (len > size - pos)
 			{
-				const char *s = luaL_checklstring(L, ++i, &len);
-				size_t sz = getsize(f, e);
-				if (sz == 0) sz = len;
-				buffer_insert(&self->buf, where, s, sz);
-				buffer_insertbyte(&self->buf, where, 0);
-				where += sz + 1;
+				err = "truncated msgpack";
 				break;
 			}
-		case F_STRING:
+			if (kind == 's')
+				buffer_writestring(out, data + pos, len);
+			else
+				buffer_writeextdata(out, type, data + pos, len);
+			pos += len;
+		}
+		else if (kind)
+		{
+			buffer_writebyte(out, OP_TABLE);
+			if (kind == 'm')
+				buffer_writebyte(out, OP_TABLE_DELIMITER);
+			if (n > 0)
 			{
-				const char *s = luaL_checklstring(L, ++i, &len);
-				size_t sz = getsize(f, e);
-				if (sz == 0) sz = len;
-				buffer_insert(&self->buf, where, s, sz);
-				where += sz;
-				break;
+				if (depth >= (size_t)maxdepth || (depth == cap && !tframes_grow(fixed, (void **)&frames, &cap, sizeof(*frames))))
+				{
+					err = "msgpack too deep";
+					break;
+				}
+				frames[depth].left = kind == 'm' ? n * 2 : n;
+				frames[depth++].map = kind == 'm';
+				continue;
 			}
-		case F_OBJECT:
+			if (kind == 'a')
+				buffer_writebyte(out, OP_TABLE_DELIMITER);
+			buffer_writebyte(out, OP_TABLE_END);
+		}
+		/* one whole item done, close the containers it completes */
+		while (depth > 0 && --frames[depth - 1].left == 0)
+		{
+			if (!frames[--depth].map)
+				buffer_writebyte(out, OP_TABLE_DELIMITER);
+			buffer_writebyte(out, OP_TABLE_END);
+		}
+	}
+	if (frames != fixed)
+		free(frames);
+	*at = pos;
+	return err;
+}
+
+static size_t json_space(const char *p, size_t pos, size_t size)
+{
+	while (pos < size && (p[pos] == ' ' || p[pos] == '\t' || p[pos] == '\n' || p[pos] == '\r'))
+		pos++;
+	return pos;
+}
+
+static int json_hex(const char *p, size_t pos, size_t size)
+{
+	int i, n = 0;
+	if (pos + 4 > size)
+		return -1;
+	for (i = 0; i < 4; ++i)
+	{
+		int c = p[pos + i];
+		n <<= 4;
+		if (c >= '0' && c <= '9')
+			n |= c - '0';
+		else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f')
+			n |= (c | 0x20) - 'a' + 10;
+		else
+			return -1;
+	}
+	return n;
+}
+
+/* reads the string after the opening quote at *at, unescaping into scratch when needed */
+static const char *json_readstring(const char *p, size_t *at, size_t size, buffer_t *out, buffer_t *scratch)
+{
+	size_t pos = *at, from = pos;
+	for (; pos < size && p[pos] != '"' && p[pos] != '\\'; ++pos)
+	{
+		if ((unsigned char)p[pos] < 0x20)
+			return "control character in json string";
+	}
+	if (pos < size && p[pos] == '"')
+	{
+		buffer_writestring(out, p + from, pos - from);
+		*at = pos + 1;
+		return NULL;
+	}
+	if (!*scratch)
+		*scratch = buffer_new(BUFF_SIZE);
+	buffer_remove(scratch, 0, buffer_tell(scratch));
+	buffer_write(scratch, p + from, pos - from);
+	while (pos < size && p[pos] != '"')
+	{
+		char utf[4];
+		int c = (unsigned char)p[pos++];
+		if (c < 0x20)
+			return "control character in json string";
+		if (c != '\\')
+		{
+			buffer_writebyte(scratch, (char)c);
+			continue;
+		}
+		if (pos >= size)
+			break;
+		switch (p[pos++])
+		{
+			case '"': buffer_writebyte(scratch, '"'); break;
+			case '\\': buffer_writebyte(scratch, '\\'); break;
+			case '/': buffer_writebyte(scratch, '/'); break;
+			case 'b': buffer_writebyte(scratch, '\b'); break;
+			case 'f': buffer_writebyte(scratch, '\f'); break;
+			case 'n': buffer_writebyte(scratch, '\n'); break;
+			case 'r': buffer_writebyte(scratch, '\r'); break;
+			case 't': buffer_writebyte(scratch, '\t'); break;
+			case 'u':
 			{
-				struct writer_t W;
-				W.count = 0;
-				if (where < buffer_tell(&self->buf))
+				long u = json_hex(p, pos, size);
+				if (u < 0 || (u >= 0xdc00 && u <= 0xdfff))
+					return "bad json unicode escape";
+				pos += 4;
+				if (u >= 0xd800 && u <= 0xdbff)
 				{
-					buffer_t buf = buffer_new(BUFF_SIZE);
-					W.pos = buffer_tell(&buf);
-					buffer_writeobject(L, &buf, ++i, &W);
-					buffer_insert(&self->buf, where, buffer_ptr(&buf), buffer_tell(&buf));
-					where += buffer_tell(&buf);
-					buffer_delete(&buf);
+					long lo = pos + 6 <= size && p[pos] == '\\' && p[pos + 1] == 'u' ? json_hex(p, pos + 2, size) : -1;
+					if (lo < 0xdc00 || lo > 0xdfff)
+						return "bad json unicode escape";
+					u = 0x10000 + ((u - 0xd800) << 10) + (lo - 0xdc00);
+					pos += 6;
+				}
+				if (u < 0x80)
+					buffer_writebyte(scratch, (char)u);
+				else if (u < 0x800)
+				{
+					utf[0] = (char)(0xc0 | (u >> 6));
+					utf[1] = (char)(0x80 | (u & 0x3f));
+					buffer_write(scratch, utf, 2);
+				}
+				else if (u < 0x10000)
+				{
+					utf[0] = (char)(0xe0 | (u >> 12));
+					utf[1] = (char)(0x80 | ((u >> 6) & 0x3f));
+					utf[2] = (char)(0x80 | (u & 0x3f));
+					buffer_write(scratch, utf, 3);
 				}
 				else
 				{
-					W.pos = buffer_tell(&self->buf);
-					buffer_writeobject(L, &self->buf, ++i, &W);
+					utf[0] = (char)(0xf0 | (u >> 18));
+					utf[1] = (char)(0x80 | ((u >> 12) & 0x3f));
+					utf[2] = (char)(0x80 | ((u >> 6) & 0x3f));
+					utf[3] = (char)(0x80 | (u & 0x3f));
+					buffer_write(scratch, utf, 4);
 				}
 				break;
 			}
-		default:
-			luaL_error(L, "unsupport format '%c'", *(--f));
-			break;
+			default:
+				return "bad json escape";
 		}
 	}
-	lua_pushnumber(L, pos);
-	lua_pushnumber(L, where);
-	return 2;
+	if (pos >= size)
+		return "unterminated json string";
+	buffer_writestring(out, buffer_ptr(scratch), buffer_tell(scratch));
+	*at = pos + 1;
+	return NULL;
 }
 
-static int luastream_readf (lua_State *L)
+/* reads the number at *at, integers stay integers unless out of range */
+static const char *json_readnumber(const char *p, size_t *at, size_t size, buffer_t *out)
 {
-	lua_Stream *self = (lua_Stream *)luaL_checkudata(L, 1, LUA_STREAM);
-	size_t len, nb = 0;
-	const char *f, *e;
-	f = luaL_checklstring(L, 2, &len);
-	e = f + len;
-	luaL_check(self->buf, "%s (released) #1", LUA_STREAM);
-	for (; f < e; f = getnext(++f, e))
+	char num[64];
+	size_t pos = *at, len;
+	int integer = 1;
+	if (pos < size && p[pos] == '-')
+		pos++;
+	if (pos >= size || !isdigit((unsigned char)p[pos]))
+		return "bad json number";
+	if (p[pos] == '0')
+		pos++;
+	else
+		while (pos < size && isdigit((unsigned char)p[pos]))
+			pos++;
+	if (pos < size && p[pos] == '.')
 	{
-		luaL_check(self->pos + getsize(f, e) <= buffer_tell(&self->buf), "read '%c' overflow", *f);
-		switch(*f)
+		integer = 0;
+		if (++pos >= size || !isdigit((unsigned char)p[pos]))
+			return "bad json number";
+		while (pos < size && isdigit((unsigned char)p[pos]))
+			pos++;
+	}
+	if (pos < size && (p[pos] | 0x20) == 'e')
+	{
+		integer = 0;
+		if (++pos < size && (p[pos] == '+' || p[pos] == '-'))
+			pos++;
+		if (pos >= size || !isdigit((unsigned char)p[pos]))
+			return "bad json number";
+		while (pos < size && isdigit((unsigned char)p[pos]))
+			pos++;
+	}
+	len = pos - *at;
+	if (len >= sizeof(num))
+		integer = 0;
+	memcpy(num, p + *at, MIN(len, sizeof(num) - 1));
+	num[MIN(len, sizeof(num) - 1)] = 0;
+	if (integer)
+	{
+		long long n;
+		errno = 0;
+		n = strtoll(num, NULL, 10);
+		if (errno == 0 && n >= LUA_MININTEGER && n <= LUA_MAXINTEGER)
+			buffer_writeinteger(out, (lua_Integer)n);
+		else
+			integer = 0;
+	}
+	if (!integer)
+		buffer_writenumber(out, (lua_Number)strtod(len < sizeof(num) ? num : p + *at, NULL));
+	*at = pos;
+	return NULL;
+}
+
+enum {
+	J_FIRST,
+	J_ITEM,
+	J_NEXT,
+};
+
+/* parses whitespace separated json values from *at to size into opcode bytes */
+static const char *stream_fromjson(const char *p, size_t *at, size_t size, buffer_t *out, int maxdepth)
+{
+	struct jframe {
+		int object;
+		int state;
+	} fixed[FRAMES_SIZE], *frames = fixed;
+	size_t depth = 0, cap = FRAMES_SIZE, pos = *at;
+	buffer_t scratch = NULL;
+	const char *err = NULL;
+	while (!err)
+	{
+		struct jframe *f = depth ? &frames[depth - 1] : NULL;
+		int c;
+		pos = json_space(p, pos, size);
+		if (pos >= size)
 		{
-		case F_SIGNED_BYTE:
+			if (depth > 0)
+				err = "truncated json";
+			break;
+		}
+		c = p[pos];
+		if (f && f->state != J_ITEM && c == (f->object ? '}' : ']'))
+		{
+			pos++;
+			if (!f->object)
+				buffer_writebyte(out, OP_TABLE_DELIMITER);
+			buffer_writebyte(out, OP_TABLE_END);
+			depth--;
+			goto done;
+		}
+		if (f && f->state == J_NEXT)
+		{
+			if (c != ',')
 			{
-				char n = 0;
-				buffer_read(&self->buf, self->pos, &n, sizeof(n));
-				correctbytes(&n, sizeof(n));
-				lua_pushnumber(L, n);
-				self->pos += sizeof(n);
+				err = "expected ',' in json";
 				break;
 			}
-		case F_UNSIGNED_BYTE:
+			f->state = J_ITEM;
+			pos++;
+			continue;
+		}
+		if (f && f->object)
+		{
+			if (c != '"')
 			{
-				unsigned char n = 0;
-				buffer_read(&self->buf, self->pos, &n, sizeof(n));
-				correctbytes(&n, sizeof(n));
-				lua_pushnumber(L, n);
-				self->pos += sizeof(n);
+				err = "expected json key";
 				break;
 			}
-		case F_SIGNED_WORD:
+			pos++;
+			if ((err = json_readstring(p, &pos, size, out, &scratch)))
+				break;
+			pos = json_space(p, pos, size);
+			if (pos >= size || p[pos] != ':')
 			{
-				short n = 0;
-				buffer_read(&self->buf, self->pos, &n, sizeof(n));
-				correctbytes(&n, sizeof(n));
-				lua_pushnumber(L, n);
-				self->pos += sizeof(n);
+				err = "expected ':' in json";
 				break;
 			}
-		case F_UNSIGNED_WORD:
+			pos = json_space(p, pos + 1, size);
+			if (pos >= size)
 			{
-				unsigned short n = 0;
-				buffer_read(&self->buf, self->pos, &n, sizeof(n));
-				correctbytes(&n, sizeof(n));
-				lua_pushnumber(L, n);
-				self->pos += sizeof(n);
+				err = "truncated json";
 				break;
 			}
-		case F_SIGNED_DWORD:
+			c = p[pos];
+		}
+		if (c == '{' || c == '[')
+		{
+			if (f)
+				f->state = J_NEXT;
+			if (depth >= (size_t)maxdepth || (depth == cap && !tframes_grow(fixed, (void **)&frames, &cap, sizeof(*frames))))
 			{
-				long n = 0;
-				buffer_read(&self->buf, self->pos, &n, sizeof(n));
-				correctbytes(&n, sizeof(n));
-				lua_pushnumber(L, n);
-				self->pos += sizeof(n);
+				err = "json too deep";
 				break;
 			}
-		case F_UNSIGNED_DWORD:
+			buffer_writebyte(out, OP_TABLE);
+			if (c == '{')
+				buffer_writebyte(out, OP_TABLE_DELIMITER);
+			frames[depth].object = c == '{';
+			frames[depth++].state = J_FIRST;
+			pos++;
+			continue;
+		}
+		if (c == '"')
+		{
+			pos++;
+			err = json_readstring(p, &pos, size, out, &scratch);
+		}
+		else if (c == '-' || isdigit(c))
+			err = json_readnumber(p, &pos, size, out);
+		else if (size - pos >= 4 && !memcmp(p + pos, "true", 4))
+			buffer_writebyte(out, OP_TRUE), pos += 4;
+		else if (size - pos >= 5 && !memcmp(p + pos, "false", 5))
+			buffer_writebyte(out, OP_FALSE), pos += 5;
+		else if (size - pos >= 4 && !memcmp(p + pos, "null", 4))
+			buffer_writebyte(out, OP_NIL), pos += 4;
+		else
+			err = "unexpected character in json";
+	done:
+		if (depth > 0)
+			frames[depth - 1].state = J_NEXT;
+		else if (!err && pos < size && json_space(p, pos, size) == pos)
+			err = "expected space between json values";
+	}
+	if (frames != fixed)
+		free(frames);
+	if (scratch)
+		buffer_delete(&scratch);
+	*at = pos;
+	return err;
+}
+
+/* reclaim the consumed head lazily, once it outgrows the unread tail */
+static void stream_autocompact(lua_Stream *self)
+{
+	size_t pos = self->pos;
+	if (self->compact && pos >= COMPACT_MIN && pos >= buffer_tell(&self->buf) - pos)
+		stream_compact(self);
+}
+
+/* a buffer size argument, negative or past INT_MAX ones raise instead of wrapping */
+static size_t checksize(lua_State *L, int idx, size_t def, int arg)
+{
+	lua_Number n = luaL_optnumber(L, idx, (lua_Number)def);
+	luaL_check(n >= 0 && n <= INT_MAX, "bad size #%d", arg);
+	return (size_t)n;
+}
+
+static int luastream_new (lua_State *L)
+{
+	const char *buf = NULL;
+	size_t len = 0, capacity = BUFF_SIZE;
+	lua_Number growth = 2;
+	int compact = 0;
+	lua_Stream *self;
+	if (lua_istable(L, 1))
+	{
+		lua_getfield(L, 1, "capacity");
+		lua_getfield(L, 1, "growth");
+		lua_getfield(L, 1, "compact");
+		capacity = checksize(L, -3, BUFF_SIZE, 1);
+		growth = luaL_optnumber(L, -2, 2);
+		compact = lua_toboolean(L, -1);
+		lua_pop(L, 3);
+		luaL_check(growth > 1, "growth must be greater than 1");
+	}
+	else
+		buf = luaL_optlstring(L, 1, NULL, &len);
+	
+	self = (lua_Stream *)lua_newuserdata(L, sizeof(lua_Stream));
+	self->buf = buffer_new(MAX(capacity, len));
+	self->pos = 0;
+	self->ref = LUA_REFNIL;
+	self->compact = compact;
+	self->valid = 0;
+	buffer_setgrowth(&self->buf, growth);
+	luaL_getmetatable(L, LUA_STREAM);
+	lua_setmetatable(L, -2);
+	if (buf)
+		buffer_write(&self->buf, buf, len);
+	return 1;
+}
+
+static int luastream_clone (lua_State *L)
+{
+	lua_Stream *self = (lua_Stream *)luaL_checkudata(L, 1, LUA_STREAM);
+	lua_Stream *other = (lua_Stream *)lua_newuserdata(L, sizeof(lua_Stream));
+	luaL_check(self->buf, "%s (released) #1", LUA_STREAM);
+	other->buf = buffer_new(buffer_tell(&self->buf));
+	other->pos = self->pos;
+	other->ref = LUA_REFNIL;
+	other->compact = self->compact;
+	other->valid = 0;
+	buffer_write(&other->buf, buffer_ptr(&self->buf), buffer_tell(&self->buf));
+	luaL_getmetatable(L, LUA_STREAM);
+	lua_setmetatable(L, -2);
+	return 1;
+}
+
+static int luastream_extract (lua_State *L)
+{
+	lua_Stream *self, *other;
+	int index = 1;
+	size_t pos, total, size;
+	self = (lua_Stream *)luaL_checkudata(L, index, LUA_STREAM);
+	luaL_check(self->buf, "%s (released) #1", LUA_STREAM);
+	if (lua_isnumber(L, index))
+		pos = lua_tonumber(L, ++index);
+	else
+		pos = buffer_tell(&self->buf);
+	other = (lua_Stream *)luaL_checkudata(L, ++index, LUA_STREAM);
+	luaL_check(pos <= buffer_tell(&self->buf), "out of range #2");
+	luaL_check(other->buf, "%s (released) #%d", LUA_STREAM, index);
+	total = buffer_tell(&other->buf);
+	size = luaL_optint(L, ++index, total > other->pos ? total - other->pos : 0);
+	luaL_check(other->pos + size <= total, "size overflow #%d", index);
+	if (pos < self->valid)
+		self->valid = 0;
+	if (size)
+		buffer_insert(&self->buf, pos, buffer_at(&other->buf, other->pos), size);
+	other->pos += size;
+	other->valid = 0;
+	stream_autocompact(other);
+	lua_pushnumber(L, pos);
+	lua_pushnumber(L, pos + size);
+	return 2;
+}
+
+static int luastream_copy (lua_State *L)
+{
+	lua_Stream *self, *other;
+	int index = 1;
+	size_t pos, total, size;
+	self = (lua_Stream *)luaL_checkudata(L, index, LUA_STREAM);
+	luaL_check(self->buf, "%s (released) #1", LUA_STREAM);
+	if (lua_isnumber(L, index))
+		pos = lua_tonumber(L, ++index);
+	else
+		pos = buffer_tell(&self->buf);
+	other = (lua_Stream *)luaL_checkudata(L, ++index, LUA_STREAM);
+	luaL_check(pos <= buffer_tell(&self->buf), "out of range #2");
+	luaL_check(other->buf, "%s (released) #%d", LUA_STREAM, index);
+	total = buffer_tell(&other->buf);
+	size = luaL_optint(L, ++index, total > other->pos ? total - other->pos : 0);
+	luaL_check(other->pos + size <= total, "size overflow #%d", index);
+	if (pos < self->valid)
+		self->valid = 0;
+	if (size)
+		buffer_insert(&self->buf, pos, buffer_at(&other->buf, other->pos), size);
+	lua_pushnumber(L, pos);
+	lua_pushnumber(L, pos + size);
+	return 2;
+}
+
+static int luastream_release (lua_State *L)
+{
+	lua_Stream *self = (lua_Stream *)luaL_checkudata(L, 1, LUA_STREAM);
+	if (self->buf)
+		buffer_delete(&self->buf);
+	return 0;
+}
+
+static int luastream_mt_tostring (lua_State *L)
+{
+	lua_Stream *self = (lua_Stream *)luaL_checkudata(L, 1, LUA_STREAM);
+	if (self->buf)
+		lua_pushfstring(L, "%s (%p)", LUA_STREAM, self);
+	else
+		lua_pushfstring(L, "%s (released)", LUA_STREAM);
+	return 1;
+}
+
+static int luastream_tostring (lua_State *L)
+{
+	lua_Stream *self = (lua_Stream *)luaL_checkudata(L, 1, LUA_STREAM);
+	if (self->buf)
+		lua_pushlstring(L, buffer_ptr(&self->buf), buffer_tell(&self->buf));
+	else
+		lua_pushnil(L);
+	return 1;
+}
+
+static int luastream_write (lua_State *L)
+{
+	size_t pos;
+	int i, top = lua_gettop(L);
+	struct writer_t W;
+	lua_Stream *self = (lua_Stream *)luaL_checkudata(L, 1, LUA_STREAM);
+	luaL_check(self->buf, "%s (released) #1", LUA_STREAM);
+	pos = buffer_tell(&self->buf);
+	writer_init(L, &W, pos);
+	for (i = 2; i <= top; ++i, W.pos = buffer_tell(&self->buf), W.count = 0)
+		buffer_writeobject(L, &self->buf, i, &W);
+	lua_pushnumber(L, pos);
+	lua_pushnumber(L, buffer_tell(&self->buf));
+	return 2;
+}
+
+static int luastream_insert (lua_State *L)
+{
+	int i, top = lua_gettop(L);
+	struct writer_t W;
+	lua_Stream *self = (lua_Stream *)luaL_checkudata(L, 1, LUA_STREAM);
+	size_t size, pos = luaL_checkint(L, 2);
+	luaL_check(self->buf, "%s (released) #1", LUA_STREAM);
+	luaL_check(pos <= buffer_tell(&self->buf), "out of range #2");
+	if (pos < self->valid)
+		self->valid = 0;
+	writer_init(L, &W, pos);
+	if (pos < buffer_tell(&self->buf))
+	{
+		buffer_t buf = buffer_new(BUFF_SIZE);
+		for (i = 3, W.pos = 0; i <= top; ++i, W.pos = buffer_tell(&buf), W.count = 0)
+			buffer_writeobject(L, &buf, i, &W);
+		size = buffer_tell(&buf);
+		buffer_insert(&self->buf, pos, buffer_ptr(&buf), size);
+		buffer_delete(&buf);
+	}
+	else
+	{
+		for (i = 3, W.pos = pos; i <= top; ++i, W.pos = buffer_tell(&self->buf), W.count = 0)
+			buffer_writeobject(L, &self->buf, i, &W);
+		size = buffer_tell(&self->buf) - pos;
+	}
+	lua_pushnumber(L, pos);
+	lua_pushnumber(L, pos + size);
+	return 2;
+}
+
+static int luastream_read (lua_State *L)
+{
+	struct reader_t R;
+	lua_Stream *self = (lua_Stream *)luaL_checkudata(L, 1, LUA_STREAM);
+	size_t i, pos, nb = luaL_optint(L, 2, 1);
+	luaL_check(self->buf, "%s (released) #1", LUA_STREAM);
+	lua_settop(L, 2);
+	luaL_checkstack(L, (int)nb + 1, "too many values, use readall");
+	reader_init(L, &R, self->pos);
+	for (i = 0; i < nb; ++i, R.pos = self->pos, R.count = 0)
+	{
+		R.trusted = self->pos < self->valid;
+		self->pos = buffer_readobject(L, buffer_ptr(&self->buf), self->pos, buffer_tell(&self->buf), &R);
+	}
+	stream_autocompact(self);
+	return nb;
+}
+
+/* writes t[1..#t] as separate values, refs are shared across them only when asked */
+static int luastream_writeall (lua_State *L)
+{
+	size_t pos;
+	int i, n, shared = lua_toboolean(L, 3);
+	struct writer_t W;
+	lua_Stream *self = (lua_Stream *)luaL_checkudata(L, 1, LUA_STREAM);
+	luaL_check(self->buf, "%s (released) #1", LUA_STREAM);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	lua_settop(L, 2);
+	n = (int)lua_rawlen(L, 2);
+	pos = buffer_tell(&self->buf);
+	writer_init(L, &W, pos);
+	/* shared values count their refs from the batch start, so offsets never collide */
+	for (i = 1; i <= n; ++i)
+	{
+		if (!shared)
+		{
+			W.pos = buffer_tell(&self->buf);
+			W.count = 0;
+		}
+		lua_rawgeti(L, 2, i);
+		buffer_writeobject(L, &self->buf, 4, &W);
+		lua_pop(L, 1);
+	}
+	lua_pushnumber(L, pos);
+	lua_pushnumber(L, buffer_tell(&self->buf));
+	return 2;
+}
+
+/* reads up to count values from R into t[1..], returns how many were read */
+static int stream_readinto(lua_State *L, lua_Stream *self, struct reader_t *R, int shared, int t, size_t count)
+{
+	size_t n = 0, size = buffer_tell(&self->buf);
+	while (n < count && self->pos < size)
+	{
+		R->trusted = self->pos < self->valid;
+		if (!shared)
+		{
+			R->pos = self->pos;
+			R->count = 0;
+		}
+		self->pos = buffer_readobject(L, buffer_ptr(&self->buf), self->pos, size, R);
+		lua_rawseti(L, t, (int)++n);
+	}
+	return (int)n;
+}
+
+static int luastream_readall (lua_State *L)
+{
+	struct reader_t R;
+	lua_Stream *self = (lua_Stream *)luaL_checkudata(L, 1, LUA_STREAM);
+	size_t left, max;
+	int n;
+	luaL_check(self->buf, "%s (released) #1", LUA_STREAM);
+	left = buffer_tell(&self->buf) - self->pos;
+	max = lua_isnoneornil(L, 2) ? left : (size_t)luaL_checkint(L, 2);
+	lua_settop(L, 3);
+	/* every value takes at least a byte, so an explicit max bounds the presize */
+	lua_createtable(L, lua_isnil(L, 2) ? 0 : (int)MIN(max, left), 0);
+	reader_init(L, &R, self->pos);
+	n = stream_readinto(L, self, &R, lua_toboolean(L, 3), 4, max);
+	stream_autocompact(self);
+	lua_settop(L, 4);
+	lua_pushinteger(L, n);
+	return 2;
+}
+
+/* upvalues: stream, batch, next index, batch size, record number, refs when shared, distance back to the shared base */
+static int luastream_next (lua_State *L)
+{
+	lua_Stream *self = (lua_Stream *)lua_touserdata(L, lua_upvalueindex(1));
+	int i = (int)lua_tointeger(L, lua_upvalueindex(3));
+	int n = (int)lua_tointeger(L, lua_upvalueindex(4));
+	luaL_check(self->buf, "%s (released) #1", LUA_STREAM);
+	if (i > n)
+	{
+		struct reader_t R;
+		int shared = lua_toboolean(L, lua_upvalueindex(6));
+		/* the shared base is kept as a distance back from the read position, which compaction keeps */
+		reader_init(L, &R, self->pos - (size_t)lua_tonumber(L, lua_upvalueindex(7)));
+		if (lua_istable(L, lua_upvalueindex(6)))
+		{
+			lua_pushvalue(L, lua_upvalueindex(6));
+			lua_replace(L, R.slot);
+			R.count = 1;
+		}
+		n = stream_readinto(L, self, &R, shared, lua_upvalueindex(2), EACH_BATCH);
+		if (shared)
+		{
+			lua_pushnumber(L, (lua_Number)(self->pos - R.pos));
+			lua_replace(L, lua_upvalueindex(7));
+			if (lua_istable(L, R.slot))
 			{
-				unsigned long n = 0;
-				buffer_read(&self->buf, self->pos, &n, sizeof(n));
-				correctbytes(&n, sizeof(n));
-				lua_pushnumber(L, n);
-				self->pos += sizeof(n);
-				break;
+				lua_pushvalue(L, R.slot);
+				lua_replace(L, lua_upvalueindex(6));
+			}
+		}
+		stream_autocompact(self);
+		lua_pushinteger(L, n);
+		lua_replace(L, lua_upvalueindex(4));
+		if (n == 0)
+			return 0;
+		i = 1;
+	}
+	lua_pushinteger(L, i + 1);
+	lua_replace(L, lua_upvalueindex(3));
+	lua_pushinteger(L, lua_tointeger(L, lua_upvalueindex(5)) + 1);
+	lua_pushvalue(L, -1);
+	lua_replace(L, lua_upvalueindex(5));
+	lua_rawgeti(L, lua_upvalueindex(2), i);
+	lua_pushnil(L);
+	lua_rawseti(L, lua_upvalueindex(2), i);
+	return 2;
+}
+
+/* for i, v in s:each() do ... end, values are decoded EACH_BATCH at a time */
+static int luastream_each (lua_State *L)
+{
+	lua_Stream *self = (lua_Stream *)luaL_checkudata(L, 1, LUA_STREAM);
+	luaL_check(self->buf, "%s (released) #1", LUA_STREAM);
+	lua_settop(L, 2);
+	lua_pushvalue(L, 1);
+	lua_createtable(L, EACH_BATCH, 0);
+	lua_pushinteger(L, 1);
+	lua_pushinteger(L, 0);
+	lua_pushinteger(L, 0);
+	lua_pushboolean(L, lua_toboolean(L, 2));
+	lua_pushnumber(L, 0);
+	lua_pushcclosure(L, luastream_next, 7);
+	return 1;
+}
+
+static int luastream_remove (lua_State *L)
+{
+	int top = lua_gettop(L);
+	lua_Stream *self = (lua_Stream *)luaL_checkudata(L, 1, LUA_STREAM);
+	size_t pos, size;
+	luaL_check(self->buf, "%s (released) #1", LUA_STREAM);
+	pos = luaL_checkint(L, 2);
+	size = luaL_checkint(L, 3);
+	stream_remove(self, pos, size);
+	return 0;
+}
+
+static int luastream_seek (lua_State *L)
+{
+	lua_Stream *self = (lua_Stream *)luaL_checkudata(L, 1, LUA_STREAM);
+	size_t pos = luaL_checkint(L, 2);
+	luaL_check(self->buf, "%s (released) #1", LUA_STREAM);
+	luaL_check(pos <= buffer_tell(&self->buf), "out of range #2");
+	self->pos = pos;
+	self->valid = 0;
+	return 0;
+}
+
+static int luastream_validate (lua_State *L)
+{
+	lua_Stream *self = (lua_Stream *)luaL_checkudata(L, 1, LUA_STREAM);
+	size_t total;
+	luaL_check(self->buf, "%s (released) #1", LUA_STREAM);
+	total = buffer_tell(&self->buf);
+	self->valid = buffer_validate(buffer_ptr(&self->buf), MAX(self->pos, self->valid), total, state_maxdepth(L));
+	lua_pushnumber(L, self->valid - self->pos);
+	lua_pushboolean(L, self->valid == total);
+	return 2;
+}
+
+static int luastream_compact (lua_State *L)
+{
+	lua_Stream *self = (lua_Stream *)luaL_checkudata(L, 1, LUA_STREAM);
+	size_t pos = self->pos;
+	luaL_check(self->buf, "%s (released) #1", LUA_STREAM);
+	stream_compact(self);
+	lua_pushnumber(L, pos);
+	return 1;
+}
+
+static int luastream_autocompact (lua_State *L)
+{
+	lua_Stream *self = (lua_Stream *)luaL_checkudata(L, 1, LUA_STREAM);
+	int compact = self->compact;
+	if (!lua_isnone(L, 2))
+		self->compact = lua_toboolean(L, 2);
+	lua_pushboolean(L, compact);
+	return 1;
+}
+
+static int luastream_reserve (lua_State *L)
+{
+	lua_Stream *self = (lua_Stream *)luaL_checkudata(L, 1, LUA_STREAM);
+	size_t size;
+	luaL_check(self->buf, "%s (released) #1", LUA_STREAM);
+	luaL_checknumber(L, 2);
+	size = checksize(L, 2, 0, 2);
+	stream_reserve(self, size);
+	lua_pushnumber(L, buffer_size(&self->buf));
+	return 1;
+}
+
+static int luastream_shrink (lua_State *L)
+{
+	lua_Stream *self = (lua_Stream *)luaL_checkudata(L, 1, LUA_STREAM);
+	luaL_check(self->buf, "%s (released) #1", LUA_STREAM);
+	stream_shrink(self);
+	lua_pushnumber(L, buffer_size(&self->buf));
+	return 1;
+}
+
+static int luastream_capacity (lua_State *L)
+{
+	lua_Stream *self = (lua_Stream *)luaL_checkudata(L, 1, LUA_STREAM);
+	luaL_check(self->buf, "%s (released) #1", LUA_STREAM);
+	lua_pushnumber(L, buffer_size(&self->buf));
+	return 1;
+}
+
+static int luastream_tell (lua_State *L)
+{
+	lua_Stream *self = (lua_Stream *)luaL_checkudata(L, 1, LUA_STREAM);
+	luaL_check(self->buf, "%s (released) #1", LUA_STREAM);
+	lua_pushnumber(L, self->pos);
+	return 1;
+}
+
+static int luastream_unread (lua_State *L)
+{
+	lua_Stream *self = (lua_Stream *)luaL_checkudata(L, 1, LUA_STREAM);
+	luaL_check(self->buf, "%s (released) #1", LUA_STREAM);
+	lua_pushnumber(L, buffer_tell(&self->buf) - self->pos);
+	return 1;
+}
+
+static int luastream_size (lua_State *L)
+{
+	lua_Stream *self = (lua_Stream *)luaL_checkudata(L, 1, LUA_STREAM);
+	luaL_check(self->buf, "%s (released) #1", LUA_STREAM);
+	lua_pushnumber(L, buffer_tell(&self->buf));
+	return 1;
+}
+
+static int luastream_empty (lua_State *L)
+{
+	lua_Stream *self = (lua_Stream *)luaL_checkudata(L, 1, LUA_STREAM);
+	if (!self->buf)
+		lua_pushnil(L);
+	else
+		lua_pushboolean(L, buffer_tell(&self->buf) == 0);
+	return 1;
+}
+
+static int luastream_eof (lua_State *L)
+{
+	lua_Stream *self = (lua_Stream *)luaL_checkudata(L, 1, LUA_STREAM);
+	luaL_check(self->buf, "%s (released) #1", LUA_STREAM);
+	lua_pushboolean(L, self->pos >= buffer_tell(&self->buf));
+	return 1;
+}
+
+#ifdef STREAM_FDIO
+static int fdio_error (lua_State *L)
+{
+	int en = errno;
+	lua_pushnil(L);
+	lua_pushstring(L, strerror(en));
+	lua_pushnumber(L, en);
+	return 3;
+}
+
+static int luastream_writeto (lua_State *L)
+{
+	lua_Stream *self = (lua_Stream *)luaL_checkudata(L, 1, LUA_STREAM);
+	int fd = luaL_checkint(L, 2);
+	int at = luaL_optint(L, 3, 0);
+	size_t total, pos, len;
+	ssize_t n;
+	luaL_check(self->buf, "%s (released) #1", LUA_STREAM);
+	total = buffer_tell(&self->buf);
+	luaL_check(at >= 0 && (size_t)at <= total, "out of range #3");
+	pos = at;
+	if (lua_isnoneornil(L, 4))
+		len = total - pos;
+	else
+	{
+		int size = luaL_checkint(L, 4);
+		luaL_check(size >= 0 && (size_t)size <= total - pos, "size overflow #4");
+		len = size;
+	}
+	do n = write(fd, buffer_ptr(&self->buf) + pos, len);
+	while (n < 0 && errno == EINTR);
+	if (n < 0)
+		return fdio_error(L);
+	lua_pushnumber(L, n);
+	return 1;
+}
+
+static int luastream_writev (lua_State *L)
+{
+	struct iovec iov[IOV_MAX];
+	int fd = luaL_checkint(L, 1);
+	int i, top = lua_gettop(L);
+	ssize_t n;
+	luaL_check(top - 1 <= IOV_MAX, "too many streams %d", top - 1);
+	for (i = 2; i <= top; ++i)
+	{
+		lua_Stream *other = (lua_Stream *)luaL_checkudata(L, i, LUA_STREAM);
+		luaL_check(other->buf, "%s (released) #%d", LUA_STREAM, i);
+		iov[i - 2].iov_base = buffer_ptr(&other->buf);
+		iov[i - 2].iov_len = buffer_tell(&other->buf);
+	}
+	do n = writev(fd, iov, top - 1);
+	while (n < 0 && errno == EINTR);
+	if (n < 0)
+		return fdio_error(L);
+	lua_pushnumber(L, n);
+	return 1;
+}
+
+static int luastream_readfrom (lua_State *L)
+{
+	lua_Stream *self = (lua_Stream *)luaL_checkudata(L, 1, LUA_STREAM);
+	int fd = luaL_checkint(L, 2);
+	int size = luaL_checkint(L, 3);
+	ssize_t n;
+	char *ptr;
+	luaL_check(self->buf, "%s (released) #1", LUA_STREAM);
+	luaL_check(size >= 0, "bad size #3");
+	ptr = buffer_prepare(&self->buf, size);
+	do n = read(fd, ptr, size);
+	while (n < 0 && errno == EINTR);
+	if (n < 0)
+		return fdio_error(L);
+	buffer_commit(&self->buf, n);
+	lua_pushnumber(L, n);
+	return 1;
+}
+
+/* stream.pipe() returns the read and write descriptors of a new pipe */
+static int luastream_pipe (lua_State *L)
+{
+	int fds[2];
+	if (pipe(fds) < 0)
+		return fdio_error(L);
+	lua_pushnumber(L, fds[0]);
+	lua_pushnumber(L, fds[1]);
+	return 2;
+}
+
+static int luastream_closefd (lua_State *L)
+{
+	if (close(luaL_checkint(L, 1)) < 0)
+		return fdio_error(L);
+	lua_pushboolean(L, 1);
+	return 1;
+}
+#endif
+
+static const char *getnext(const char *f, const char *e)
+{
+	while(f < e && isdigit(*f)) ++f;
+	return f;
+}
+
+static size_t getsize(const char *f, const char *e)
+{
+	if (f < e)
+	{
+		switch (*f)
+		{
+			case 'b': case 'B':
+				return 1;
+			case 'w': case 'W':
+				return 2;
+			case 'd': case 'D':
+				return 4;
+			case 's':
+				return atoi(++f);
+		}
+	}
+	return 0;
+}
+
+/* bit fields, packed low bit first through a 64 bit accumulator and padded to a byte before any byte field */
+struct bits_t {
+	uint64_t acc;
+	int n;
+};
+
+static int getbits(lua_State *L, const char *f, const char *e)
+{
+	int bits = 1;
+	if (*f != F_BIT)
+	{
+		bits = atoi(f + 1);
+		luaL_check(bits >= 1 && bits <= 32, "bit field '%c%d' out of 1..32", *f, bits);
+	}
+	return bits;
+}
+
+/* adds the low bits of v, returns how many whole bytes went to out */
+static int bits_put(struct bits_t *b, uint64_t v, int bits, char *out)
+{
+	int k = 0;
+	b->acc |= (v & ((1ull << bits) - 1)) << b->n;
+	for (b->n += bits; b->n >= 8; b->n -= 8, b->acc >>= 8)
+		out[k++] = (char)b->acc;
+	return k;
+}
+
+static int bits_flush(struct bits_t *b, char *out)
+{
+	int k = b->n > 0;
+	out[0] = (char)b->acc;
+	b->acc = 0;
+	b->n = 0;
+	return k;
+}
+
+static uint64_t bits_get(lua_State *L, lua_Stream *self, struct bits_t *b, int bits)
+{
+	uint64_t v;
+	for (; b->n < bits; b->n += 8)
+	{
+		luaL_check(self->pos < buffer_tell(&self->buf), "read bits overflow");
+		b->acc |= (uint64_t)(unsigned char)*buffer_at(&self->buf, self->pos++) << b->n;
+	}
+	v = b->acc & ((1ull << bits) - 1);
+	b->acc >>= bits;
+	b->n -= bits;
+	return v;
+}
+
+/* the value at idx as the bits of a bit field */
+static uint64_t bits_of(lua_State *L, int idx, char type)
+{
+	if (type == F_BIT)
+		return lua_toboolean(L, idx);
+	return (uint64_t)(int64_t)luaL_checknumber(L, idx);
+}
+
+static void bits_push(lua_State *L, uint64_t v, int bits, char type)
+{
+	if (type == F_BIT)
+		lua_pushboolean(L, (int)v);
+	else if (type == F_SIGNED_BITS && (v >> (bits - 1)) & 1)
+		lua_pushnumber(L, (lua_Number)((int64_t)v - ((int64_t)1 << bits)));
+	else
+		lua_pushnumber(L, (lua_Number)v);
+}
+
+/* half and range quantized float fields, converted PACK_CHUNK values at a time */
+struct fspec {
+	int half;
+	int bits;
+	int bulk;
+	size_t count;
+	lua_Number lo;
+	lua_Number hi;
+};
+
+/* parses 'h' or 'q<bits>[lo,hi]' with an optional '*<count>' bulk suffix, returns its last char */
+static const char *getspec(lua_State *L, const char *f, const char *e, struct fspec *s)
+{
+	char *end;
+	s->half = *f == F_HALF;
+	s->bits = 16;
+	s->bulk = 0;
+	s->count = 0;
+	s->lo = 0;
+	s->hi = 1;
+	if (*f == F_QUANTIZED)
+	{
+		s->bits = atoi(f + 1);
+		f = getnext(f + 1, e);
+		luaL_check(s->bits == 8 || s->bits == 16 || s->bits == 32, "quantized bits must be 8, 16 or 32");
+		luaL_check(f < e && *f == '[', "expected '[' after 'q%d'", s->bits);
+		s->lo = strtod(f + 1, &end);
+		luaL_check(end < e && *end == ',', "bad quantized range");
+		s->hi = strtod(end + 1, &end);
+		luaL_check(end < e && *end == ']' && s->hi > s->lo, "bad quantized range");
+		f = end;
+	}
+	if (f + 1 < e && f[1] == F_BULK)
+	{
+		s->bulk = 1;
+		s->count = atoi(f + 2);
+		f = getnext(f + 2, e) - 1;
+	}
+	return f;
+}
+
+/* round to nearest even, like the F16C conversion */
+static unsigned short float_tohalf(float f)
+{
+	uint32_t x, mant, rem, h, sign;
+	int exp;
+	memcpy(&x, &f, sizeof(x));
+	sign = (x >> 16) & 0x8000;
+	mant = x & 0x7fffff;
+	if (((x >> 23) & 0xff) == 0xff)
+		return (unsigned short)(sign | 0x7c00 | (mant ? 0x200 | (mant >> 13) : 0));
+	exp = (int)((x >> 23) & 0xff) - 127 + 15;
+	if (exp >= 31)
+		return (unsigned short)(sign | 0x7c00);
+	if (exp <= 0)
+	{
+		int shift = 14 - exp;
+		if (shift > 24)
+			return (unsigned short)sign;
+		mant |= 0x800000;
+		h = mant >> shift;
+		rem = mant & ((1u << shift) - 1);
+		if (rem > (1u << (shift - 1)) || (rem == (1u << (shift - 1)) && (h & 1)))
+			h++;
+		return (unsigned short)(sign | h);
+	}
+	h = ((uint32_t)exp << 10) | (mant >> 13);
+	rem = mant & 0x1fff;
+	/* a carry rolls into the exponent, up to infinity */
+	if (rem > 0x1000 || (rem == 0x1000 && (h & 1)))
+		h++;
+	return (unsigned short)(sign | h);
+}
+
+static float half_tofloat(unsigned short h)
+{
+	uint32_t sign = (uint32_t)(h & 0x8000) << 16, exp = (h >> 10) & 0x1f, mant = h & 0x3ff, x;
+	float f;
+	if (exp == 0x1f)
+		x = sign | 0x7f800000 | (mant << 13);
+	else if (exp)
+		x = sign | ((exp + 112) << 23) | (mant << 13);
+	else
+	{
+		f = mant * (1.0f / 16777216);
+		return sign ? -f : f;
+	}
+	memcpy(&f, &x, sizeof(f));
+	return f;
+}
+
+static void halfs_encode(unsigned short *dst, const float *src, size_t n)
+{
+	size_t i = 0;
+#ifdef __F16C__
+	for (; i + 4 <= n; i += 4)
+		_mm_storel_epi64((__m128i *)(dst + i), _mm_cvtps_ph(_mm_loadu_ps(src + i), 0));
+#endif
+	for (; i < n; ++i)
+		dst[i] = float_tohalf(src[i]);
+}
+
+static void halfs_decode(float *dst, const unsigned short *src, size_t n)
+{
+	size_t i = 0;
+#ifdef __F16C__
+	for (; i + 4 <= n; i += 4)
+		_mm_storeu_ps(dst + i, _mm_cvtph_ps(_mm_loadl_epi64((const __m128i *)(src + i))));
+#endif
+	for (; i < n; ++i)
+		dst[i] = half_tofloat(src[i]);
+}
+
+/* the quantize loops clamp first, nan lands on lo */
+#define QUANT_ENCODE(T) \
+	{ \
+		T *q = (T *)dst; \
+		for (i = 0; i < n; ++i) \
+		{ \
+			lua_Number x = (src[i] - s->lo) * scale; \
+			x = x > 0 ? x : 0; \
+			q[i] = (T)((x < top ? x : top) + 0.5); \
+		} \
+		for (i = 0; i < n; ++i) \
+			correctbytes(q + i, sizeof(T)); \
+	}
+
+#define QUANT_DECODE(T) \
+	{ \
+		T *q = (T *)src; \
+		for (i = 0; i < n; ++i) \
+			correctbytes(q + i, sizeof(T)); \
+		for (i = 0; i < n; ++i) \
+			dst[i] = s->lo + q[i] * unit; \
+	}
+
+static void pack_encode(uint32_t *dst, const lua_Number *src, size_t n, const struct fspec *s)
+{
+	lua_Number top = (lua_Number)(s->bits == 32 ? 0xffffffffu : (1u << s->bits) - 1);
+	lua_Number scale = top / (s->hi - s->lo);
+	size_t i;
+	if (s->half)
+	{
+		float f[PACK_CHUNK];
+		for (i = 0; i < n; ++i)
+			f[i] = (float)src[i];
+		halfs_encode((unsigned short *)dst, f, n);
+		for (i = 0; i < n; ++i)
+			correctbytes((unsigned short *)dst + i, sizeof(unsigned short));
+	}
+	else if (s->bits == 8)
+		QUANT_ENCODE(uint8_t)
+	else if (s->bits == 16)
+		QUANT_ENCODE(uint16_t)
+	else
+		QUANT_ENCODE(uint32_t)
+}
+
+static void pack_decode(lua_Number *dst, uint32_t *src, size_t n, const struct fspec *s)
+{
+	lua_Number top = (lua_Number)(s->bits == 32 ? 0xffffffffu : (1u << s->bits) - 1);
+	lua_Number unit = (s->hi - s->lo) / top;
+	size_t i;
+	if (s->half)
+	{
+		float f[PACK_CHUNK];
+		for (i = 0; i < n; ++i)
+			correctbytes((unsigned short *)src + i, sizeof(unsigned short));
+		halfs_decode(f, (unsigned short *)src, n);
+		for (i = 0; i < n; ++i)
+			dst[i] = f[i];
+	}
+	else if (s->bits == 8)
+		QUANT_DECODE(uint8_t)
+	else if (s->bits == 16)
+		QUANT_DECODE(uint16_t)
+	else
+		QUANT_DECODE(uint32_t)
+}
+
+/* writes the number at idx, or every number of the array at idx for bulk fields */
+static void buffer_writepacked(lua_State *L, buffer_t *buf, int idx, const struct fspec *s)
+{
+	lua_Number src[PACK_CHUNK];
+	uint32_t dst[PACK_CHUNK];
+	size_t i, k, m, n = 1;
+	if (s->bulk)
+	{
+		luaL_checktype(L, idx, LUA_TTABLE);
+		n = s->count ? s->count : lua_rawlen(L, idx);
+	}
+	for (i = 0; i < n; i += m)
+	{
+		m = MIN(n - i, PACK_CHUNK);
+		for (k = 0; k < m; ++k)
+		{
+			if (!s->bulk)
+			{
+				src[k] = luaL_checknumber(L, idx);
+				continue;
+			}
+			lua_rawgeti(L, idx, (int)(i + k + 1));
+			luaL_check(lua_isnumber(L, -1), "bad array item %d", (int)(i + k + 1));
+			src[k] = lua_tonumber(L, -1);
+			lua_pop(L, 1);
+		}
+		pack_encode(dst, src, m, s);
+		buffer_write(buf, dst, m * (s->bits / 8));
+	}
+}
+
+/* pushes the number at the read position, or a table of count numbers for bulk fields */
+static void stream_readpacked(lua_State *L, lua_Stream *self, const struct fspec *s)
+{
+	lua_Number dst[PACK_CHUNK];
+	uint32_t src[PACK_CHUNK];
+	size_t i, k, m, n = s->bulk ? s->count : 1, size = s->bits / 8;
+	luaL_check(!s->bulk || n > 0, "bulk reads need a count");
+	luaL_check(n <= (buffer_tell(&self->buf) - self->pos) / size, "read '%c' overflow", s->half ? F_HALF : F_QUANTIZED);
+	if (s->bulk)
+		lua_createtable(L, (int)n, 0);
+	for (i = 0; i < n; i += m)
+	{
+		m = MIN(n - i, PACK_CHUNK);
+		memcpy(src, buffer_ptr(&self->buf) + self->pos + i * size, m * size);
+		pack_decode(dst, src, m, s);
+		for (k = 0; k < m; ++k)
+		{
+			lua_pushnumber(L, dst[k]);
+			if (s->bulk)
+				lua_rawseti(L, -2, (int)(i + k + 1));
+		}
+	}
+	self->pos += n * size;
+}
+
+static int luastream_writef (lua_State *L)
+{
+	lua_Stream *self = (lua_Stream *)luaL_checkudata(L, 1, LUA_STREAM);
+	size_t len, pos, i = 2;
+	const char *f, *e;
+	struct bits_t B = {0, 0};
+	char out[8];
+	f = luaL_checklstring(L, 2, &len);
+	e = f + len;
+	luaL_check(self->buf, "%s (released) #1", LUA_STREAM);
+	pos = buffer_tell(&self->buf);
+	for (; f < e; f = getnext(++f, e))
+	{
+		if (B.n && !F_ISBITS(*f))
+			buffer_write(&self->buf, out, bits_flush(&B, out));
+		switch(*f)
+		{
+		case F_SIGNED_BYTE:
+			{
+				char n = luaL_checkinteger(L, ++i);
+				correctbytes(&n, sizeof(n));
+				buffer_write(&self->buf, &n, sizeof(n));
+				break;
+			}
+		case F_UNSIGNED_BYTE:
+			{
+				unsigned char n = luaL_checkinteger(L, ++i);
+				correctbytes(&n, sizeof(n));
+				buffer_write(&self->buf, &n, sizeof(n));
+				break;
+			}
+		case F_SIGNED_WORD:
+			{
+				short n = luaL_checkinteger(L, ++i);
+				correctbytes(&n, sizeof(n));
+				buffer_write(&self->buf, &n, sizeof(n));
+				break;
+			}
+		case F_UNSIGNED_WORD:
+			{
+				unsigned short n = luaL_checkinteger(L, ++i);
+				correctbytes(&n, sizeof(n));
+				buffer_write(&self->buf, &n, sizeof(n));
+				break;
+			}
+		case F_SIGNED_DWORD:
+			{
+				long n = luaL_checkinteger(L, ++i);
+				correctbytes(&n, sizeof(n));
+				buffer_write(&self->buf, &n, sizeof(n));
+				break;
+			}
+		case F_UNSIGNED_DWORD:
+			{
+				unsigned long n = luaL_checkinteger(L, ++i);
+				correctbytes(&n, sizeof(n));
+				buffer_write(&self->buf, &n, sizeof(n));
+				break;
+			}
+		case F_FLOAT:
+			{
+				lua_Number n = luaL_checknumber(L, ++i);
+				correctbytes(&n, sizeof(n));
+				buffer_write(&self->buf, &n, sizeof(n));
+				break;
+			}
+		case F_ZSTRING:
+			{
+				const char *s = luaL_checklstring(L, ++i, &len);
+				size_t sz = getsize(f, e);
+				if (sz == 0) sz = len;
+				buffer_write(&self->buf, s, sz);
+				buffer_writebyte(&self->buf, 0);
+				break;
+			}
+		case F_STRING:
+			{
+				const char *s = luaL_checklstring(L, ++i, &len);
+				size_t sz = getsize(f, e);
+				if (sz == 0) sz = len;
+				buffer_write(&self->buf, s, sz);
+				break;
+			}
+		case F_OBJECT:
+			{
+				struct writer_t W;
+				writer_init(L, &W, buffer_tell(&self->buf));
+				buffer_writeobject(L, &self->buf, ++i, &W);
+				lua_pop(L, 1);
+				break;
+			}
+		case F_HALF:
+		case F_QUANTIZED:
+			{
+				struct fspec spec;
+				f = getspec(L, f, e, &spec);
+				buffer_writepacked(L, &self->buf, ++i, &spec);
+				break;
+			}
+		case F_UNSIGNED_BITS:
+		case F_SIGNED_BITS:
+		case F_BIT:
+			{
+				int bits = getbits(L, f, e);
+				uint64_t v = bits_of(L, ++i, *f);
+				buffer_write(&self->buf, out, bits_put(&B, v, bits, out));
+				break;
+			}
+		default:
+			luaL_error(L, "unsupport format '%c'", *(--f));
+			break;
+		}
+	}
+	buffer_write(&self->buf, out, bits_flush(&B, out));
+	lua_pushnumber(L, pos);
+	lua_pushnumber(L, buffer_tell(&self->buf));
+	return 2;
+}
+
+static int luastream_insertf (lua_State *L)
+{
+	lua_Stream *self = (lua_Stream *)luaL_checkudata(L, 1, LUA_STREAM);
+	size_t len, where, i = 3, pos = luaL_checkint(L, 2);
+	const char *f, *e;
+	struct bits_t B = {0, 0};
+	char out[8];
+	int k;
+	f = luaL_checklstring(L, 3, &len);
+	e = f + len;
+	luaL_check(self->buf, "%s (released) #1", LUA_STREAM);
+	luaL_check(pos <= buffer_tell(&self->buf), "out of range #2");
+	if (pos < self->valid)
+		self->valid = 0;
+	for (where = pos; f < e; f = getnext(++f, e))
+	{
+		if (B.n && !F_ISBITS(*f))
+		{
+			k = bits_flush(&B, out);
+			buffer_insert(&self->buf, where, out, k);
+			where += k;
+		}
+		switch(*f)
+		{
+		case F_SIGNED_BYTE:
+			{
+				char n = luaL_checkinteger(L, ++i);
+				correctbytes(&n, sizeof(n));
+				buffer_insert(&self->buf, where, &n, sizeof(n));
+				where += sizeof(n);
+				break;
+			}
+		case F_UNSIGNED_BYTE:
+			{
+				unsigned char n = luaL_checkinteger(L, ++i);
+				correctbytes(&n, sizeof(n));
+				buffer_insert(&self->buf, where, &n, sizeof(n));
+				where += sizeof(n);
+				break;
+			}
+		case F_SIGNED_WORD:
+			{
+				short n = luaL_checkinteger(L, ++i);
+				correctbytes(&n, sizeof(n));
+				buffer_insert(&self->buf, where, &n, sizeof(n));
+				where += sizeof(n);
+				break;
+			}
+		case F_UNSIGNED_WORD:
+			{
+				unsigned short n = luaL_checkinteger(L, ++i);
+				correctbytes(&n, sizeof(n));
+				buffer_insert(&self->buf, where, &n, sizeof(n));
+				where += sizeof(n);
+				break;
+			}
+		case F_SIGNED_DWORD:
+			{
+				long n = luaL_checkinteger(L, ++i);
+				correctbytes(&n, sizeof(n));
+				buffer_insert(&self->buf, where, &n, sizeof(n));
+				where += sizeof(n);
+				break;
+			}
+		case F_UNSIGNED_DWORD:
+			{
+				unsigned long n = luaL_checkinteger(L, ++i);
+				correctbytes(&n, sizeof(n));
+				buffer_insert(&self->buf, where, &n, sizeof(n));
+				where += sizeof(n);
+				break;
+			}
+		case F_FLOAT:
+			{
+				lua_Number n = luaL_checknumber(L, ++i);
+				correctbytes(&n, sizeof(n));
+				buffer_insert(&self->buf, where, &n, sizeof(n));
+				where += sizeof(n);
+				break;
+			}
+		case F_ZSTRING:
+			{
+				const char *s = luaL_checklstring(L, ++i, &len);
+				size_t sz = getsize(f, e);
+				if (sz == 0) sz = len;
+				buffer_insert(&self->buf, where, s, sz);
+				buffer_insertbyte(&self->buf, where, 0);
+				where += sz + 1;
+				break;
+			}
+		case F_STRING:
+			{
+				const char *s = luaL_checklstring(L, ++i, &len);
+				size_t sz = getsize(f, e);
+				if (sz == 0) sz = len;
+				buffer_insert(&self->buf, where, s, sz);
+				where += sz;
+				break;
+			}
+		case F_OBJECT:
+			{
+				struct writer_t W;
+				writer_init(L, &W, buffer_tell(&self->buf));
+				if (where < buffer_tell(&self->buf))
+				{
+					buffer_t buf = buffer_new(BUFF_SIZE);
+					W.pos = buffer_tell(&buf);
+					buffer_writeobject(L, &buf, ++i, &W);
+					buffer_insert(&self->buf, where, buffer_ptr(&buf), buffer_tell(&buf));
+					where += buffer_tell(&buf);
+					buffer_delete(&buf);
+				}
+				else
+					buffer_writeobject(L, &self->buf, ++i, &W);
+				lua_pop(L, 1);
+				break;
+			}
+		case F_HALF:
+		case F_QUANTIZED:
+			{
+				struct fspec spec;
+				buffer_t buf;
+				f = getspec(L, f, e, &spec);
+				buf = buffer_new(BUFF_SIZE);
+				buffer_writepacked(L, &buf, ++i, &spec);
+				buffer_insert(&self->buf, where, buffer_ptr(&buf), buffer_tell(&buf));
+				where += buffer_tell(&buf);
+				buffer_delete(&buf);
+				break;
+			}
+		case F_UNSIGNED_BITS:
+		case F_SIGNED_BITS:
+		case F_BIT:
+			{
+				int bits = getbits(L, f, e);
+				uint64_t v = bits_of(L, ++i, *f);
+				k = bits_put(&B, v, bits, out);
+				buffer_insert(&self->buf, where, out, k);
+				where += k;
+				break;
+			}
+		default:
+			luaL_error(L, "unsupport format '%c'", *(--f));
+			break;
+		}
+	}
+	k = bits_flush(&B, out);
+	buffer_insert(&self->buf, where, out, k);
+	where += k;
+	lua_pushnumber(L, pos);
+	lua_pushnumber(L, where);
+	return 2;
+}
+
+static int luastream_readf (lua_State *L)
+{
+	lua_Stream *self = (lua_Stream *)luaL_checkudata(L, 1, LUA_STREAM);
+	size_t len, nb = 0;
+	const char *f, *e;
+	struct bits_t B = {0, 0};
+	f = luaL_checklstring(L, 2, &len);
+	e = f + len;
+	luaL_check(self->buf, "%s (released) #1", LUA_STREAM);
+	self->valid = 0;
+	for (; f < e; f = getnext(++f, e))
+	{
+		/* the rest of a partly read byte is padding */
+		if (!F_ISBITS(*f))
+			B.n = 0, B.acc = 0;
+		luaL_check(self->pos + getsize(f, e) <= buffer_tell(&self->buf), "read '%c' overflow", *f);
+		switch(*f)
+		{
+		case F_SIGNED_BYTE:
+			{
+				char n = 0;
+				buffer_read(&self->buf, self->pos, &n, sizeof(n));
+				correctbytes(&n, sizeof(n));
+				lua_pushnumber(L, n);
+				self->pos += sizeof(n);
+				break;
+			}
+		case F_UNSIGNED_BYTE:
+			{
+				unsigned char n = 0;
+				buffer_read(&self->buf, self->pos, &n, sizeof(n));
+				correctbytes(&n, sizeof(n));
+				lua_pushnumber(L, n);
+				self->pos += sizeof(n);
+				break;
+			}
+		case F_SIGNED_WORD:
+			{
+				short n = 0;
+				buffer_read(&self->buf, self->pos, &n, sizeof(n));
+				correctbytes(&n, sizeof(n));
+				lua_pushnumber(L, n);
+				self->pos += sizeof(n);
+				break;
+			}
+		case F_UNSIGNED_WORD:
+			{
+				unsigned short n = 0;
+				buffer_read(&self->buf, self->pos, &n, sizeof(n));
+				correctbytes(&n, sizeof(n));
+				lua_pushnumber(L, n);
+				self->pos += sizeof(n);
+				break;
+			}
+		case F_SIGNED_DWORD:
+			{
+				long n = 0;
+				buffer_read(&self->buf, self->pos, &n, sizeof(n));
+				correctbytes(&n, sizeof(n));
+				lua_pushnumber(L, n);
+				self->pos += sizeof(n);
+				break;
+			}
+		case F_UNSIGNED_DWORD:
+			{
+				unsigned long n = 0;
+				buffer_read(&self->buf, self->pos, &n, sizeof(n));
+				correctbytes(&n, sizeof(n));
+				lua_pushnumber(L, n);
+				self->pos += sizeof(n);
+				break;
 			}
 		case F_FLOAT:
 			{
@@ -884,40 +3267,1805 @@ static int luastream_readf (lua_State *L)
 			}
 		case F_ZSTRING:
 			{
-				const char *s = buffer_at(&self->buf, self->pos);
-				size_t sz = strlen(s);
-				lua_pushlstring(L, s, sz);
-				self->pos += sz + 1;
+				const char *s = buffer_at(&self->buf, self->pos);
+				size_t sz = strlen(s);
+				lua_pushlstring(L, s, sz);
+				self->pos += sz + 1;
+				break;
+			}
+		case F_STRING:
+			{
+				const char *s = buffer_at(&self->buf, self->pos);
+				size_t sz = getsize(f, e);
+				lua_pushlstring(L, s, sz);
+				self->pos += sz;
+				break;
+			}
+		case F_OBJECT:
+			{
+				struct reader_t R;
+				reader_init(L, &R, self->pos);
+				self->pos = buffer_readobject(L, buffer_ptr(&self->buf), self->pos, buffer_tell(&self->buf), &R);
+				lua_remove(L, R.slot);
+				break;
+			}
+		case F_HALF:
+		case F_QUANTIZED:
+			{
+				struct fspec spec;
+				f = getspec(L, f, e, &spec);
+				stream_readpacked(L, self, &spec);
+				break;
+			}
+		case F_UNSIGNED_BITS:
+		case F_SIGNED_BITS:
+		case F_BIT:
+			{
+				int bits = getbits(L, f, e);
+				bits_push(L, bits_get(L, self, &B, bits), bits, *f);
+				break;
+			}
+		default:
+			luaL_error(L, "unsupport format '%c'", *(--f));
+			break;
+		}
+		++nb;
+	}
+	stream_autocompact(self);
+	return nb;
+}
+
+static int luastream_diff (lua_State *L)
+{
+	struct writer_t W;
+	lua_Stream *self;
+	luaL_checktype(L, 1, LUA_TTABLE);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	lua_settop(L, 2);
+	lua_newtable(L);
+	self = (lua_Stream *)lua_newuserdata(L, sizeof(lua_Stream));
+	self->buf = buffer_new(BUFF_SIZE);
+	self->pos = 0;
+	self->ref = LUA_REFNIL;
+	self->compact = 0;
+	self->valid = 0;
+	luaL_getmetatable(L, LUA_STREAM);
+	lua_setmetatable(L, -2);
+	writer_init(L, &W, 0);
+	buffer_writepatch(L, &self->buf, 1, 2, 3, &W, state_maxdepth(L));
+	lua_settop(L, 4);
+	return 1;
+}
+
+static int luastream_patch (lua_State *L)
+{
+	struct reader_t R;
+	lua_Stream *self = (lua_Stream *)luaL_checkudata(L, 1, LUA_STREAM);
+	luaL_check(self->buf, "%s (released) #1", LUA_STREAM);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	lua_settop(L, 2);
+	reader_init(L, &R, self->pos);
+	self->valid = 0;
+	self->pos = buffer_readpatch(L, buffer_ptr(&self->buf), self->pos, buffer_tell(&self->buf), &R, 2, state_maxdepth(L));
+	lua_settop(L, 2);
+	stream_autocompact(self);
+	return 1;
+}
+
+/* transcodes the value at the read position and consumes it, nil at the end */
+static int stream_pushtranscoded (lua_State *L, int json)
+{
+	lua_Stream *self = (lua_Stream *)luaL_checkudata(L, 1, LUA_STREAM);
+	size_t pos;
+	const char *err;
+	buffer_t out;
+	luaL_check(self->buf, "%s (released) #1", LUA_STREAM);
+	pos = self->pos;
+	if (pos >= buffer_tell(&self->buf))
+		return 0;
+	out = buffer_new(BUFF_SIZE);
+	err = stream_transcode(buffer_ptr(&self->buf), &pos, buffer_tell(&self->buf), &out, json, state_maxdepth(L));
+	if (!err)
+		lua_pushlstring(L, buffer_ptr(&out), buffer_tell(&out));
+	buffer_delete(&out);
+	luaL_check(!err, "%s at %d", err, (int)self->pos);
+	self->pos = pos;
+	stream_autocompact(self);
+	return 1;
+}
+
+static int luastream_tomsgpack (lua_State *L)
+{
+	return stream_pushtranscoded(L, 0);
+}
+
+static int luastream_tojson (lua_State *L)
+{
+	return stream_pushtranscoded(L, 1);
+}
+
+/* a new stream holding every value of the msgpack or json text */
+static int stream_newtranscoded (lua_State *L, int json)
+{
+	size_t len, pos = 0;
+	const char *data = luaL_checklstring(L, 1, &len), *err;
+	int depth = state_maxdepth(L);
+	lua_Stream *self = (lua_Stream *)lua_newuserdata(L, sizeof(lua_Stream));
+	self->buf = buffer_new(MAX(len, BUFF_SIZE));
+	self->pos = 0;
+	self->ref = LUA_REFNIL;
+	self->compact = 0;
+	self->valid = 0;
+	luaL_getmetatable(L, LUA_STREAM);
+	lua_setmetatable(L, -2);
+	err = json ? stream_fromjson(data, &pos, len, &self->buf, depth) : stream_frommsgpack(data, &pos, len, &self->buf, depth);
+	luaL_check(!err, "%s at %d", err, (int)pos);
+	return 1;
+}
+
+static int luastream_frommsgpack (lua_State *L)
+{
+	return stream_newtranscoded(L, 0);
+}
+
+static int luastream_fromjson (lua_State *L)
+{
+	return stream_newtranscoded(L, 1);
+}
+
+static int hasshared(lua_State *L, int idx, int seen, int left)
+{
+	int top = lua_gettop(L);
+	/* recurses in C, so it stops at stream.maxdepth like the encoder */
+	luaL_check(left > 0, "table too deep");
+	luaL_checkstack(L, LUA_MINSTACK, "table too deep");
+	lua_pushvalue(L, idx);
+	lua_rawget(L, seen);
+	if (lua_toboolean(L, -1))
+	{
+		lua_settop(L, top);
+		return 1;
+	}
+	lua_pushvalue(L, idx);
+	lua_pushboolean(L, 1);
+	lua_rawset(L, seen);
+	lua_pushnil(L);
+	while (lua_next(L, idx))
+	{
+		if ((lua_istable(L, -2) && hasshared(L, lua_gettop(L) - 1, seen, left - 1)) ||
+			(lua_istable(L, -1) && hasshared(L, lua_gettop(L), seen, left - 1)))
+		{
+			lua_settop(L, top);
+			return 1;
+		}
+		lua_pop(L, 1);
+	}
+	lua_settop(L, top);
+	return 0;
+}
+
+static int luastream_freeze (lua_State *L)
+{
+	struct writer_t W;
+	buffer_t buf;
+	int shared;
+	luaL_checktype(L, 1, LUA_TTABLE);
+	lua_settop(L, 1);
+	lua_getfield(L, LUA_REGISTRYINDEX, LUA_FROZEN);
+	if (!lua_istable(L, 2))
+	{
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_newtable(L);
+		lua_pushstring(L, "k");
+		lua_setfield(L, -2, "__mode");
+		lua_setmetatable(L, -2);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, LUA_REGISTRYINDEX, LUA_FROZEN);
+	}
+	lua_pushvalue(L, 1);
+	lua_pushnil(L);
+	lua_rawset(L, 2);
+	
+	lua_newtable(L);
+	shared = hasshared(L, 1, 3, state_maxdepth(L));
+	buf = buffer_new(BUFF_SIZE);
+	buffer_writebyte(&buf, shared);
+	writer_init(L, &W, buffer_tell(&buf));
+	buffer_writeobject(L, &buf, 1, &W);
+	/* the entry: blob, then each subtable the writer met with its offset */
+	lua_pushvalue(L, 1);
+	lua_newtable(L);
+	lua_pushlstring(L, buffer_ptr(&buf), buffer_tell(&buf));
+	buffer_delete(&buf);
+	lua_rawseti(L, -2, 1);
+	if (W.count > 0)
+	{
+		int n = 1;
+		lua_pushnil(L);
+		while (lua_next(L, W.slot))
+		{
+			if (lua_rawequal(L, -2, 1))
+			{
+				lua_pop(L, 1);
+				continue;
+			}
+			lua_pushvalue(L, -2);
+			lua_rawseti(L, -4, ++n);
+			lua_rawseti(L, -3, ++n);
+		}
+	}
+	lua_rawset(L, 2);
+	lua_settop(L, 1);
+	return 1;
+}
+
+static int luastream_thaw (lua_State *L)
+{
+	luaL_checktype(L, 1, LUA_TTABLE);
+	lua_settop(L, 1);
+	lua_getfield(L, LUA_REGISTRYINDEX, LUA_FROZEN);
+	if (lua_istable(L, 2))
+	{
+		lua_pushvalue(L, 1);
+		lua_pushnil(L);
+		lua_rawset(L, 2);
+	}
+	lua_settop(L, 1);
+	return 1;
+}
+
+static int luastream_register (lua_State *L)
+{
+	int type = luaL_checkint(L, 1);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	lua_getfield(L, 2, "__serialize");
+	lua_getfield(L, 2, "__deserialize");
+	luaL_check(lua_isfunction(L, -2) && lua_isfunction(L, -1), "__serialize and __deserialize expected #2");
+	ext_register(L, type, 2, NULL, NULL);
+	return 0;
+}
+
+static int luastream_maxdepth (lua_State *L)
+{
+	int depth = state_maxdepth(L);
+	if (!lua_isnone(L, 1))
+	{
+		int n = luaL_checkint(L, 1);
+		luaL_check(n > 0, "bad depth %d", n);
+		lua_pushnumber(L, n);
+		lua_setfield(L, LUA_REGISTRYINDEX, LUA_MAXDEPTH);
+	}
+	lua_pushnumber(L, depth);
+	return 1;
+}
+
+static int luastream_stats (lua_State *L)
+{
+#ifdef STREAM_STATS
+	int i;
+	lua_newtable(L);
+#define setstat(t, k, v) lua_pushnumber(L, v), lua_setfield(L, t, k)
+	setstat(-2, "reallocs", buffer_stats.reallocs);
+	setstat(-2, "realloc_bytes", buffer_stats.realloc_bytes);
+	setstat(-2, "inserts", buffer_stats.inserts);
+	setstat(-2, "insert_moved", buffer_stats.insert_moved);
+	setstat(-2, "removes", buffer_stats.removes);
+	setstat(-2, "remove_moved", buffer_stats.remove_moved);
+	setstat(-2, "refs_total", stream_stats.refs_total);
+	setstat(-2, "refs_max", stream_stats.refs_max);
+	lua_newtable(L);
+	for (i = 0; i <= OP_BAD; ++i)
+		if (stream_stats.encoded[i]) setstat(-2, opnames[i], stream_stats.encoded[i]);
+	lua_setfield(L, -2, "encoded");
+	lua_newtable(L);
+	for (i = 0; i <= OP_BAD; ++i)
+		if (stream_stats.decoded[i]) setstat(-2, opnames[i], stream_stats.decoded[i]);
+	lua_setfield(L, -2, "decoded");
+#undef setstat
+#else
+	lua_pushnil(L);
+#endif
+	return 1;
+}
+
+static int luastream_resetstats (lua_State *L)
+{
+#ifdef STREAM_STATS
+	memset(&buffer_stats, 0, sizeof(buffer_stats));
+	memset(&stream_stats, 0, sizeof(stream_stats));
+#endif
+	return 0;
+}
+
+/*
+ * chains of received blocks, decoded in place: items inside a block go
+ * through buffer_readvalue on the block itself, only an item cut by a block
+ * edge is gathered into scratch first. the strings stay anchored until read.
+ */
+struct block {
+	const char *data;
+	size_t size;
+	size_t start;
+	int id;
+};
+
+struct cursor {
+	size_t b;
+	size_t off;
+};
+
+typedef struct lua_Chain {
+	struct block *blocks;
+	size_t first;
+	size_t count;
+	size_t cap;
+	size_t off;
+	size_t end;
+	struct cursor scan;
+	int depth;
+	int anchors;
+	int next;
+	buffer_t scratch;
+} lua_Chain;
+
+/* bytes of the item at p from its header, 0 while the header itself is cut; bad items count 1 and fail in buffer_readvalue */
+static size_t item_length(const unsigned char *p, size_t avail)
+{
+	int op = p[0], len = op >> 4;
+	size_t n = 0;
+	switch (opcodes[op])
+	{
+		case OP_FIXSTR:
+			return 1 + (op - FIXSTR_BASE);
+		case OP_INT:
+		case OP_FLOAT:
+			return 1 + len;
+		case OP_TABLE_REF:
+			return 1 + (len ? len : 1);
+		case OP_STRING:
+			if (len > (int)sizeof(n))
+				return 1;
+			if (avail < (size_t)1 + len)
+				return 0;
+			memcpy(&n, p + 1, len);
+			correctbytes(&n, sizeof(n));
+			return n > (size_t)-1 - 1 - len ? 1 : 1 + len + n;
+		case OP_EXT:
+			if (len > (int)sizeof(n))
+				return 1;
+			if (avail < (size_t)2 + len)
+				return 0;
+			memcpy(&n, p + 2, len);
+			correctbytes(&n, sizeof(n));
+			return n > (size_t)-1 - 2 - len ? 1 : 2 + len + n;
+		default:
+			return 1;
+	}
+}
+
+/* the byte at cur, moving off exhausted blocks; 0 at the end of the chain */
+static int chain_peek(lua_Chain *C, struct cursor *cur, int *op)
+{
+	while (cur->b < C->count && cur->off == C->blocks[cur->b].size)
+	{
+		cur->b++;
+		cur->off = 0;
+	}
+	if (cur->b == C->count)
+		return 0;
+	*op = (unsigned char)C->blocks[cur->b].data[cur->off];
+	return 1;
+}
+
+static size_t chain_tell(lua_Chain *C, struct cursor *cur)
+{
+	return cur->b < C->count ? C->blocks[cur->b].start + cur->off : C->end;
+}
+
+/* copies size bytes from cur on into dst and moves past them */
+static void chain_copy(lua_Chain *C, struct cursor *cur, char *dst, size_t size)
+{
+	while (size > 0)
+	{
+		struct block *b = &C->blocks[cur->b];
+		size_t n = MIN(size, b->size - cur->off);
+		memcpy(dst, b->data + cur->off, n);
+		dst += n;
+		size -= n;
+		cur->off += n;
+		if (cur->off == b->size && size > 0)
+		{
+			cur->b++;
+			cur->off = 0;
+		}
+	}
+}
+
+/* moves cur size bytes on */
+static void chain_skip(lua_Chain *C, struct cursor *cur, size_t size)
+{
+	while (size > 0)
+	{
+		size_t n = MIN(size, C->blocks[cur->b].size - cur->off);
+		size -= n;
+		cur->off += n;
+		if (cur->off == C->blocks[cur->b].size && size > 0)
+		{
+			cur->b++;
+			cur->off = 0;
+		}
+	}
+}
+
+/*
+ * skips whole items from where the last call stopped, 1 once the value at the
+ * read position has all its bytes; nothing is decoded until then
+ */
+static int chain_complete(lua_Chain *C)
+{
+	struct cursor *cur = &C->scan;
+	int op;
+	while (chain_peek(C, cur, &op))
+	{
+		struct block *b = &C->blocks[cur->b];
+		size_t left = C->end - chain_tell(C, cur), len;
+		unsigned char header[10];
+		len = item_length((const unsigned char *)b->data + cur->off, b->size - cur->off);
+		if (!len)
+		{
+			struct cursor head = *cur;
+			chain_copy(C, &head, (char *)header, MIN(sizeof(header), left));
+			len = item_length(header, MIN(sizeof(header), left));
+		}
+		if (!len || len > left)
+			return 0;
+		chain_skip(C, cur, len);
+		if (opcodes[op] == OP_TABLE)
+			C->depth++;
+		else if (opcodes[op] == OP_TABLE_END)
+			C->depth--;
+		if (C->depth <= 0)
+			return 1;
+	}
+	return 0;
+}
+
+/* like buffer_readvalue, -1 when the chain ends inside the item */
+static int chain_readvalue(lua_State *L, lua_Chain *C, struct cursor *cur, struct reader_t *R, struct frames *F, size_t base)
+{
+	struct block *b = &C->blocks[cur->b];
+	size_t avail = b->size - cur->off, left = C->end - chain_tell(C, cur), len, at;
+	struct cursor head = *cur;
+	unsigned char header[10];
+	len = item_length((const unsigned char *)b->data + cur->off, avail);
+	/* refs count from the value base, R->pos maps data offsets onto it */
+	if (len && len <= avail)
+	{
+		int table;
+		at = cur->off;
+		R->pos = base - b->start;
+		table = buffer_readvalue(L, b->data, &at, b->size, R, F);
+		cur->off = at;
+		return table;
+	}
+	chain_copy(C, &head, (char *)header, MIN(sizeof(header), left));
+	len = item_length(header, MIN(sizeof(header), left));
+	if (!len || len > left)
+		return -1;
+	buffer_remove(&C->scratch, 0, buffer_tell(&C->scratch));
+	R->pos = base - chain_tell(C, cur);
+	chain_copy(C, cur, buffer_prepare(&C->scratch, len), len);
+	buffer_commit(&C->scratch, len);
+	at = 0;
+	return buffer_readvalue(L, buffer_ptr(&C->scratch), &at, len, R, F);
+}
+
+/* decodes one value at cur, 0 with the stack as it was when the chain runs out first */
+static int chain_readobject(lua_State *L, lua_Chain *C, struct cursor *cur, struct reader_t *R)
+{
+	struct frames F;
+	size_t base = chain_tell(C, cur);
+	int op, top = lua_gettop(L);
+	luaL_checkstack(L, LUA_MINSTACK, "readobject");
+	frames_init(L, &F);
+	do
+	{
+		struct frame *f = F.count ? &F.base[F.count - 1] : NULL;
+		if (!chain_peek(C, cur, &op))
+		{
+			lua_settop(L, top);
+			return 0;
+		}
+		if (f && f->phase == F_ARRAY && op == OP_TABLE_DELIMITER)
+		{
+			cur->off++;
+			f->phase = F_KEY;
+			continue;
+		}
+		if (f && f->phase == F_KEY && op == OP_TABLE_END)
+		{
+			cur->off++;
+			F.count--;
+		}
+		else
+		{
+			int table = chain_readvalue(L, C, cur, R, &F, base);
+			if (table < 0)
+			{
+				lua_settop(L, top);
+				return 0;
+			}
+			if (table)
+				continue;
+		}
+		if (F.count == 0)
+			break;
+		f = &F.base[F.count - 1];
+		switch (f->phase)
+		{
+			case F_ARRAY:
+				lua_rawseti(L, f->idx, f->i++);
+				break;
+			case F_KEY:
+				f->phase = F_VALUE;
+				break;
+			case F_VALUE:
+				lua_settable(L, f->idx);
+				f->phase = F_KEY;
 				break;
+		}
+	} while (F.count > 0);
+	lua_replace(L, F.slot);
+	return 1;
+}
+
+static lua_Chain *checkchain(lua_State *L)
+{
+	return (lua_Chain *)luaL_checkudata(L, 1, LUA_CHAIN);
+}
+
+static int luastream_chain (lua_State *L)
+{
+	lua_Chain *self = (lua_Chain *)lua_newuserdata(L, sizeof(lua_Chain));
+	memset(self, 0, sizeof(*self));
+	self->anchors = LUA_NOREF;
+	luaL_getmetatable(L, LUA_CHAIN);
+	lua_setmetatable(L, -2);
+	lua_newtable(L);
+	self->anchors = luaL_ref(L, LUA_REGISTRYINDEX);
+	self->scratch = buffer_new(BUFF_SIZE);
+	return 1;
+}
+
+/* c:append(str) queues the string as a block, without copying it */
+static int luachain_append (lua_State *L)
+{
+	lua_Chain *self = checkchain(L);
+	size_t len;
+	const char *data = luaL_checklstring(L, 2, &len);
+	struct block *b;
+	if (len == 0)
+		return 0;
+	if (self->count == self->cap)
+	{
+		/* slide the unread blocks down before growing */
+		if (self->first > 0)
+		{
+			memmove(self->blocks, self->blocks + self->first, (self->count - self->first) * sizeof(*b));
+			self->count -= self->first;
+			self->scan.b -= self->first;
+			self->first = 0;
+		}
+		if (self->count == self->cap)
+		{
+			size_t cap = self->cap ? self->cap * 2 : 16;
+			b = (struct block *)realloc(self->blocks, cap * sizeof(*b));
+			luaL_check(b, "out of memory");
+			self->blocks = b;
+			self->cap = cap;
+		}
+	}
+	b = &self->blocks[self->count++];
+	b->data = data;
+	b->size = len;
+	b->start = self->end;
+	b->id = ++self->next;
+	self->end += len;
+	lua_rawgeti(L, LUA_REGISTRYINDEX, self->anchors);
+	lua_pushvalue(L, 2);
+	lua_rawseti(L, -2, b->id);
+	return 0;
+}
+
+/* c:read() decodes the next value across blocks, nil, 'incomplete' until all its bytes came */
+static int luachain_read (lua_State *L)
+{
+	lua_Chain *self = checkchain(L);
+	struct cursor cur;
+	struct reader_t R;
+	int op;
+	lua_settop(L, 1);
+	cur.b = self->first;
+	cur.off = self->off;
+	reader_init(L, &R, 0);
+	/* a value cut short is only scanned, so k appends cost O(k) rather than k decodes */
+	if (!chain_complete(self) || !chain_readobject(L, self, &cur, &R))
+	{
+		lua_pushnil(L);
+		lua_pushliteral(L, "incomplete");
+		return 2;
+	}
+	/* let go of the blocks read through */
+	chain_peek(self, &cur, &op);
+	lua_rawgeti(L, LUA_REGISTRYINDEX, self->anchors);
+	for (; self->first < cur.b; ++self->first)
+	{
+		lua_pushnil(L);
+		lua_rawseti(L, -2, self->blocks[self->first].id);
+	}
+	lua_pop(L, 1);
+	self->off = cur.off;
+	self->scan = cur;
+	self->depth = 0;
+	return 1;
+}
+
+/* unread bytes, blocks held */
+static int luachain_size (lua_State *L)
+{
+	lua_Chain *self = checkchain(L);
+	struct cursor cur;
+	cur.b = self->first;
+	cur.off = self->off;
+	lua_pushnumber(L, (lua_Number)(self->end - chain_tell(self, &cur)));
+	lua_pushnumber(L, (lua_Number)(self->count - self->first));
+	return 2;
+}
+
+static int luachain_gc (lua_State *L)
+{
+	lua_Chain *self = checkchain(L);
+	free(self->blocks);
+	self->blocks = NULL;
+	self->first = self->count = self->cap = 0;
+	if (self->scratch)
+		buffer_delete(&self->scratch);
+	luaL_unref(L, LUA_REGISTRYINDEX, self->anchors);
+	self->anchors = LUA_NOREF;
+	return 0;
+}
+
+static const struct luaL_Reg chain_funcs[] = {
+	{"append", luachain_append},
+	{"read", luachain_read},
+	{"size", luachain_size},
+	{"__gc", luachain_gc},
+	{NULL, NULL}
+};
+
+#ifdef STREAM_LOG
+/*
+ * append only record log: a directory of segment files named after their
+ * first record number. a record is framed as a 4 byte length, an 8 byte time
+ * and one encoded value. a full segment is sealed with a footer of sparse
+ * index entries (record, offset, time), one per log.every records, and a
+ * trailer; the open segment has none and its index is rebuilt from the frame
+ * headers. reads go through read only mappings and decode only what they
+ * return, record numbers and times are found from the index.
+ */
+#define LOG_MAGIC	0x31474f4c4d525453ULL
+#define LOG_HEADER	12
+#define LOG_TRAILER	24
+#define LOG_SEGMENT	(64 << 20)
+#define LOG_EVERY	64
+#define LOG_SYNC	256
+
+struct log_entry {
+	uint64_t n;
+	uint64_t off;
+	double time;
+};
+
+struct segment {
+	uint64_t first;
+	uint64_t count;
+	uint64_t size;
+	struct log_entry *index;
+	size_t nindex;
+	size_t capindex;
+	char *map;
+	size_t mapped;
+};
+
+typedef struct lua_Log {
+	struct segment *segs;
+	size_t nsegs;
+	size_t capsegs;
+	int fd;
+	int every;
+	int syncs;
+	int unsynced;
+	size_t limit;
+	buffer_t scratch;
+	char path[PATH_MAX];
+} lua_Log;
+
+static lua_Log *checklog(lua_State *L)
+{
+	lua_Log *self = (lua_Log *)luaL_checkudata(L, 1, LUA_LOG);
+	luaL_check(self->scratch, "%s (closed) #1", LUA_LOG);
+	return self;
+}
+
+static double log_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* the path is checked to leave room for the file name, so it is never cut */
+static void log_name(lua_Log *self, uint64_t first, char *name)
+{
+	int len = snprintf(name, PATH_MAX, "%s/%020llu.log", self->path, (unsigned long long)first);
+	(void)len;
+	assert(len > 0 && len < PATH_MAX);
+}
+
+static void log_frame(const char *p, uint32_t *len, double *time)
+{
+	memcpy(len, p, sizeof(*len));
+	correctbytes(len, sizeof(*len));
+	if (time)
+	{
+		memcpy(time, p + 4, sizeof(*time));
+		correctbytes(time, sizeof(*time));
+	}
+}
+
+/* the length of the frame at off, which has to lie within the frames of g */
+static uint32_t segment_frame(lua_State *L, lua_Log *self, struct segment *g, const char *data, uint64_t off, double *time)
+{
+	uint32_t len;
+	luaL_check(off <= g->size && g->size - off >= LOG_HEADER, "bad record in %s", self->path);
+	log_frame(data + off, &len, time);
+	luaL_check(len <= g->size - off - LOG_HEADER, "bad record in %s", self->path);
+	return len;
+}
+
+static void segment_index(lua_State *L, struct segment *g, uint64_t n, uint64_t off, double time)
+{
+	struct log_entry *e;
+	if (g->nindex == g->capindex)
+	{
+		size_t cap = g->capindex ? g->capindex * 2 : 16;
+		e = (struct log_entry *)realloc(g->index, cap * sizeof(*e));
+		luaL_check(e, "out of memory");
+		g->index = e;
+		g->capindex = cap;
+	}
+	e = &g->index[g->nindex++];
+	e->n = n;
+	e->off = off;
+	e->time = time;
+}
+
+static struct segment *log_addsegment(lua_State *L, lua_Log *self, uint64_t first)
+{
+	struct segment *g;
+	if (self->nsegs == self->capsegs)
+	{
+		size_t cap = self->capsegs ? self->capsegs * 2 : 16;
+		g = (struct segment *)realloc(self->segs, cap * sizeof(*g));
+		luaL_check(g, "out of memory");
+		self->segs = g;
+		self->capsegs = cap;
+	}
+	g = &self->segs[self->nsegs++];
+	memset(g, 0, sizeof(*g));
+	g->first = first;
+	return g;
+}
+
+/* maps the frames of g, the open segment with room to grow into */
+static const char *segment_map(lua_State *L, lua_Log *self, struct segment *g)
+{
+	char name[PATH_MAX];
+	size_t size;
+	int fd;
+	if (g->mapped >= g->size)
+		return g->map;
+	if (g->map)
+		munmap(g->map, g->mapped);
+	g->map = NULL;
+	g->mapped = 0;
+	size = g == &self->segs[self->nsegs - 1] && self->fd >= 0 ? MAX(g->size, self->limit) : g->size;
+	log_name(self, g->first, name);
+	fd = open(name, O_RDONLY);
+	luaL_check(fd >= 0, "open %s: %s", name, strerror(errno));
+	g->map = (char *)mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (g->map == MAP_FAILED)
+	{
+		g->map = NULL;
+		luaL_error(L, "mmap %s: %s", name, strerror(errno));
+	}
+	g->mapped = size;
+	return g->map;
+}
+
+/* reads the footer of a sealed segment, 0 when there is none */
+static int segment_load(lua_State *L, struct segment *g, int fd, uint64_t size, const char *name)
+{
+	uint64_t trailer[3];
+	size_t i, n;
+	if (size < LOG_TRAILER || pread(fd, trailer, LOG_TRAILER, size - LOG_TRAILER) != LOG_TRAILER)
+		return 0;
+	for (i = 0; i < 3; ++i)
+		correctbytes(&trailer[i], sizeof(trailer[i]));
+	if (trailer[2] != LOG_MAGIC || trailer[0] > size - LOG_TRAILER || (size - LOG_TRAILER - trailer[0]) % sizeof(struct log_entry))
+		return 0;
+	n = (size - LOG_TRAILER - trailer[0]) / sizeof(struct log_entry);
+	g->index = (struct log_entry *)malloc(MAX(n, 1) * sizeof(struct log_entry));
+	luaL_check(g->index, "out of memory");
+	g->capindex = MAX(n, 1);
+	luaL_check(pread(fd, g->index, n * sizeof(struct log_entry), trailer[0]) == (ssize_t)(n * sizeof(struct log_entry)), "read %s: %s", name, strerror(errno));
+	for (i = 0; i < n; ++i)
+	{
+		correctbytes(&g->index[i].n, sizeof(g->index[i].n));
+		correctbytes(&g->index[i].off, sizeof(g->index[i].off));
+		correctbytes(&g->index[i].time, sizeof(g->index[i].time));
+		/* entries start at the first frame and grow, all below the footer */
+		luaL_check(i > 0 ? g->index[i].n > g->index[i - 1].n && g->index[i].off > g->index[i - 1].off
+			: g->index[i].n == 0 && g->index[i].off == 0, "bad index in %s", name);
+		luaL_check(g->index[i].n < trailer[1] && g->index[i].off < trailer[0], "bad index in %s", name);
+	}
+	luaL_check(n > 0 || trailer[1] == 0, "bad index in %s", name);
+	g->nindex = n;
+	g->count = trailer[1];
+	g->size = trailer[0];
+	return 1;
+}
+
+/*
+ * walks the frames of an open segment, cutting a torn last record. a frame
+ * stops the walk unless it holds exactly one valid value, which also ends it
+ * at a torn footer, as the first index entry starts with a zero length
+ */
+static void segment_scan(lua_State *L, lua_Log *self, struct segment *g, int fd, uint64_t size, const char *name)
+{
+	const char *data;
+	uint64_t off = 0;
+	uint32_t len;
+	double time;
+	if (size == 0)
+		return;
+	data = (const char *)mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	luaL_check(data != MAP_FAILED, "mmap %s: %s", name, strerror(errno));
+	while (off + LOG_HEADER <= size)
+	{
+		log_frame(data + off, &len, &time);
+		if (len == 0 || len > size - off - LOG_HEADER
+			|| buffer_validate(data + off + LOG_HEADER, 0, len, state_maxdepth(L)) != len)
+			break;
+		if (g->count % self->every == 0)
+			segment_index(L, g, g->count, off, time);
+		g->count++;
+		off += LOG_HEADER + len;
+	}
+	munmap((void *)data, size);
+	g->size = off;
+	if (off < size && ftruncate(fd, off) < 0)
+		luaL_error(L, "ftruncate %s: %s", name, strerror(errno));
+}
+
+static void log_write(lua_State *L, int fd, const char *data, size_t size)
+{
+	while (size > 0)
+	{
+		ssize_t n = write(fd, data, size);
+		if (n < 0 && errno == EINTR)
+			continue;
+		luaL_check(n > 0, "write: %s", strerror(errno));
+		data += n;
+		size -= n;
+	}
+}
+
+/* writes the index footer of the open segment and closes it, scratch keeps what it held */
+static void log_seal(lua_State *L, lua_Log *self)
+{
+	struct segment *g = &self->segs[self->nsegs - 1];
+	size_t i, at = buffer_tell(&self->scratch);
+	uint64_t trailer[3];
+	for (i = 0; i < g->nindex; ++i)
+	{
+		struct log_entry e = g->index[i];
+		correctbytes(&e.n, sizeof(e.n));
+		correctbytes(&e.off, sizeof(e.off));
+		correctbytes(&e.time, sizeof(e.time));
+		buffer_write(&self->scratch, &e, sizeof(e));
+	}
+	trailer[0] = g->size;
+	trailer[1] = g->count;
+	trailer[2] = LOG_MAGIC;
+	for (i = 0; i < 3; ++i)
+		correctbytes(&trailer[i], sizeof(trailer[i]));
+	buffer_write(&self->scratch, trailer, sizeof(trailer));
+	log_write(L, self->fd, buffer_ptr(&self->scratch) + at, buffer_tell(&self->scratch) - at);
+	buffer_remove(&self->scratch, at, buffer_tell(&self->scratch) - at);
+	fsync(self->fd);
+	close(self->fd);
+	self->fd = -1;
+	self->unsynced = 0;
+	/* the mapping was sized for appends */
+	if (g->map)
+		munmap(g->map, g->mapped);
+	g->map = NULL;
+	g->mapped = 0;
+}
+
+static void log_open(lua_State *L, lua_Log *self, uint64_t first)
+{
+	char name[PATH_MAX];
+	int dir;
+	log_name(self, first, name);
+	self->fd = open(name, O_WRONLY | O_CREAT | O_EXCL | O_APPEND, 0644);
+	luaL_check(self->fd >= 0, "open %s: %s", name, strerror(errno));
+	log_addsegment(L, self, first);
+	/* the new name has to survive a crash as well */
+	if ((dir = open(self->path, O_RDONLY)) >= 0)
+	{
+		fsync(dir);
+		close(dir);
+	}
+}
+
+static int log_compare(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+/* the segment holding record n (0 based) and the offset of its frame */
+static struct segment *log_locate(lua_State *L, lua_Log *self, uint64_t n, uint64_t *at)
+{
+	size_t lo = 0, hi = self->nsegs;
+	struct segment *g;
+	const char *data;
+	uint64_t i, off;
+	uint32_t len;
+	while (hi - lo > 1)
+	{
+		size_t mid = (lo + hi) / 2;
+		if (self->segs[mid].first <= n)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	g = &self->segs[lo];
+	if (self->nsegs == 0 || n < g->first || n - g->first >= g->count)
+		return NULL;
+	n -= g->first;
+	lo = 0;
+	hi = g->nindex;
+	while (hi - lo > 1)
+	{
+		size_t mid = (lo + hi) / 2;
+		if (g->index[mid].n <= n)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	data = segment_map(L, self, g);
+	for (i = g->index[lo].n, off = g->index[lo].off; i < n; ++i)
+	{
+		len = segment_frame(L, self, g, data, off, NULL);
+		off += LOG_HEADER + len;
+	}
+	*at = off;
+	return g;
+}
+
+/* decodes the record at off, pushes value and time */
+static void log_read(lua_State *L, lua_Log *self, struct segment *g, uint64_t *at)
+{
+	const char *data = segment_map(L, self, g);
+	uint64_t off = *at;
+	struct reader_t R;
+	uint32_t len;
+	double time;
+	len = segment_frame(L, self, g, data, off, &time);
+	off += LOG_HEADER;
+	reader_init(L, &R, off);
+	buffer_readobject(L, data, off, off + len, &R);
+	lua_remove(L, -2);
+	lua_pushnumber(L, time);
+	*at = off + len;
+}
+
+static int log_total(lua_Log *self)
+{
+	struct segment *g = self->nsegs ? &self->segs[self->nsegs - 1] : NULL;
+	return g ? (int)(g->first + g->count) : 0;
+}
+
+/* stream.log(dir [, {segment = bytes, every = n, sync = n}]) opens or creates a record log */
+static int luastream_log (lua_State *L)
+{
+	const char *path = luaL_checkstring(L, 1);
+	char name[PATH_MAX];
+	uint64_t *firsts = NULL;
+	size_t i, n = 0, cap = 0;
+	struct dirent *d;
+	lua_Log *self;
+	DIR *dir;
+	luaL_check(strlen(path) < PATH_MAX - 32, "path too long #1");
+	lua_settop(L, 2);
+	self = (lua_Log *)lua_newuserdata(L, sizeof(lua_Log));
+	memset(self, 0, sizeof(*self));
+	self->fd = -1;
+	self->limit = LOG_SEGMENT;
+	self->every = LOG_EVERY;
+	self->syncs = LOG_SYNC;
+	strcpy(self->path, path);
+	luaL_getmetatable(L, LUA_LOG);
+	lua_setmetatable(L, -2);
+	if (lua_istable(L, 2))
+	{
+		lua_getfield(L, 2, "segment");
+		lua_getfield(L, 2, "every");
+		lua_getfield(L, 2, "sync");
+		self->limit = (size_t)luaL_optnumber(L, -3, LOG_SEGMENT);
+		self->every = luaL_optint(L, -2, LOG_EVERY);
+		self->syncs = luaL_optint(L, -1, LOG_SYNC);
+		lua_pop(L, 3);
+		luaL_check(self->limit >= LOG_HEADER && self->every > 0 && self->syncs >= 0, "bad log options #2");
+	}
+	self->scratch = buffer_new(BUFF_SIZE);
+	if (mkdir(path, 0755) < 0)
+		luaL_check(errno == EEXIST, "mkdir %s: %s", path, strerror(errno));
+	dir = opendir(path);
+	luaL_check(dir, "opendir %s: %s", path, strerror(errno));
+	while ((d = readdir(dir)))
+	{
+		unsigned long long first;
+		char tail;
+		if (strlen(d->d_name) != 24 || sscanf(d->d_name, "%20llu.lo%c", &first, &tail) != 2 || tail != 'g')
+			continue;
+		if (n == cap)
+		{
+			uint64_t *more = (uint64_t *)realloc(firsts, (cap = cap ? cap * 2 : 16) * sizeof(*firsts));
+			if (!more)
+			{
+				free(firsts);
+				closedir(dir);
+				luaL_error(L, "out of memory");
 			}
-		case F_STRING:
+			firsts = more;
+		}
+		firsts[n++] = first;
+	}
+	closedir(dir);
+	if (n > 0)
+	{
+		/* keep the names out of reach of errors while loading */
+		uint64_t *copy = (uint64_t *)lua_newuserdata(L, n * sizeof(*firsts));
+		memcpy(copy, firsts, n * sizeof(*firsts));
+		free(firsts);
+		firsts = copy;
+		qsort(firsts, n, sizeof(*firsts), log_compare);
+	}
+	else
+		free(firsts);
+	for (i = 0; i < n; ++i)
+	{
+		struct segment *g = log_addsegment(L, self, firsts[i]);
+		struct stat st;
+		int fd;
+		luaL_check(i == 0 || g->first == g[-1].first + g[-1].count, "gap in log %s before record %d", path, (int)g->first + 1);
+		log_name(self, g->first, name);
+		fd = open(name, i + 1 == n ? O_RDWR | O_APPEND : O_RDONLY);
+		luaL_check(fd >= 0, "open %s: %s", name, strerror(errno));
+		if (fstat(fd, &st) < 0 || !segment_load(L, g, fd, (uint64_t)st.st_size, name))
+		{
+			segment_scan(L, self, g, fd, (uint64_t)st.st_size, name);
+			if (i + 1 == n)
 			{
-				const char *s = buffer_at(&self->buf, self->pos);
-				size_t sz = getsize(f, e);
-				lua_pushlstring(L, s, sz);
-				self->pos += sz;
-				break;
+				self->fd = fd;
+				continue;
 			}
-		case F_OBJECT:
+		}
+		close(fd);
+	}
+	lua_settop(L, 3);
+	return 1;
+}
+
+/* log:append(v [, time]) writes one record, time defaults to now; returns its number */
+static int lualog_append (lua_State *L)
+{
+	lua_Log *self = checklog(L);
+	double time = luaL_optnumber(L, 3, log_now());
+	struct segment *g = self->nsegs ? &self->segs[self->nsegs - 1] : NULL;
+	struct writer_t W;
+	size_t len;
+	uint32_t n;
+	double t = time;
+	luaL_checkany(L, 2);
+	lua_settop(L, 2);
+	buffer_remove(&self->scratch, 0, buffer_tell(&self->scratch));
+	buffer_prepare(&self->scratch, LOG_HEADER);
+	buffer_commit(&self->scratch, LOG_HEADER);
+	writer_init(L, &W, LOG_HEADER);
+	buffer_writeobject(L, &self->scratch, 2, &W);
+	len = buffer_tell(&self->scratch);
+	luaL_check(len - LOG_HEADER <= 0xffffffffu, "record too big");
+	n = (uint32_t)(len - LOG_HEADER);
+	correctbytes(&n, sizeof(n));
+	memcpy(buffer_ptr(&self->scratch), &n, sizeof(n));
+	correctbytes(&t, sizeof(t));
+	memcpy(buffer_ptr(&self->scratch) + 4, &t, sizeof(t));
+	if (g && self->fd >= 0 && g->size > 0 && g->size + len > self->limit)
+		log_seal(L, self);
+	if (!g || self->fd < 0)
+	{
+		log_open(L, self, g ? g->first + g->count : 0);
+		g = &self->segs[self->nsegs - 1];
+	}
+	log_write(L, self->fd, buffer_ptr(&self->scratch), len);
+	if (g->count % self->every == 0)
+		segment_index(L, g, g->count, g->size, time);
+	g->count++;
+	g->size += len;
+	if (self->syncs > 0 && ++self->unsynced >= self->syncs)
+	{
+		fsync(self->fd);
+		self->unsynced = 0;
+	}
+	lua_pushnumber(L, (lua_Number)(g->first + g->count));
+	return 1;
+}
+
+/* log:get(i) returns record i and its time */
+static int lualog_get (lua_State *L)
+{
+	lua_Log *self = checklog(L);
+	lua_Number i = luaL_checknumber(L, 2);
+	struct segment *g;
+	uint64_t off;
+	luaL_check(i >= 1 && i <= log_total(self), "record out of range #2");
+	g = log_locate(L, self, (uint64_t)i - 1, &off);
+	log_read(L, self, g, &off);
+	return 2;
+}
+
+static int lualog_next (lua_State *L)
+{
+	lua_Log *self = (lua_Log *)lua_touserdata(L, lua_upvalueindex(1));
+	uint64_t n = (uint64_t)lua_tonumber(L, lua_upvalueindex(2));
+	uint64_t last = (uint64_t)lua_tonumber(L, lua_upvalueindex(3));
+	size_t k = (size_t)lua_tonumber(L, lua_upvalueindex(4));
+	uint64_t off = (uint64_t)lua_tonumber(L, lua_upvalueindex(5));
+	luaL_check(self->scratch, "%s (closed)", LUA_LOG);
+	if (n >= last)
+		return 0;
+	if (off >= self->segs[k].size)
+	{
+		k++;
+		off = 0;
+		luaL_check(k < self->nsegs, "bad record in %s", self->path);
+	}
+	lua_pushnumber(L, (lua_Number)(n + 1));
+	log_read(L, self, &self->segs[k], &off);
+	lua_pushnumber(L, (lua_Number)(n + 1));
+	lua_replace(L, lua_upvalueindex(2));
+	lua_pushnumber(L, (lua_Number)k);
+	lua_replace(L, lua_upvalueindex(4));
+	lua_pushnumber(L, (lua_Number)off);
+	lua_replace(L, lua_upvalueindex(5));
+	return 3;
+}
+
+/* for i, v, time in log:range([first [, last]]) walks records without a lookup per step */
+static int lualog_range (lua_State *L)
+{
+	lua_Log *self = checklog(L);
+	int total = log_total(self);
+	int first = luaL_optint(L, 2, 1), last = MIN(luaL_optint(L, 3, total), total);
+	struct segment *g = NULL;
+	uint64_t off = 0;
+	luaL_check(first >= 1, "record out of range #2");
+	if (first <= last)
+		g = log_locate(L, self, first - 1, &off);
+	lua_pushvalue(L, 1);
+	lua_pushnumber(L, first - 1);
+	lua_pushnumber(L, g ? last : 0);
+	lua_pushnumber(L, g ? (lua_Number)(g - self->segs) : 0);
+	lua_pushnumber(L, (lua_Number)off);
+	lua_pushcclosure(L, lualog_next, 5);
+	return 1;
+}
+
+/* log:find(time) returns the first record at or after time, times being in append order */
+static int lualog_find (lua_State *L)
+{
+	lua_Log *self = checklog(L);
+	double t = luaL_checknumber(L, 2), time;
+	size_t lo = 0, hi = self->nsegs, k;
+	uint64_t off, n;
+	uint32_t len;
+	while (hi - lo > 1)
+	{
+		size_t mid = (lo + hi) / 2;
+		if (self->segs[mid].nindex > 0 && self->segs[mid].index[0].time < t)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	for (k = lo; k < self->nsegs; ++k)
+	{
+		struct segment *g = &self->segs[k];
+		const char *data;
+		if (g->nindex == 0)
+			continue;
+		lo = 0;
+		hi = g->nindex;
+		while (hi - lo > 1)
+		{
+			size_t mid = (lo + hi) / 2;
+			if (g->index[mid].time < t)
+				lo = mid;
+			else
+				hi = mid;
+		}
+		data = segment_map(L, self, g);
+		for (n = g->index[lo].n, off = g->index[lo].off; n < g->count; ++n, off += LOG_HEADER + len)
+		{
+			len = segment_frame(L, self, g, data, off, &time);
+			if (time >= t)
 			{
-				size_t i;
-				struct reader_t R;
-				R.count = 0;
-				R.pos = self->pos;
-				self->pos = buffer_readobject(L, buffer_ptr(&self->buf), self->pos, buffer_tell(&self->buf), &R);
-				for (i = 0; i < R.count; ++i)
-					luaL_unref(L, LUA_REGISTRYINDEX, R.refs[i].idx);
-				break;
+				lua_pushnumber(L, (lua_Number)(g->first + n + 1));
+				return 1;
 			}
-		default:
-			luaL_error(L, "unsupport format '%c'", *(--f));
+		}
+	}
+	return 0;
+}
+
+/* number of records */
+static int lualog_count (lua_State *L)
+{
+	lua_pushnumber(L, log_total(checklog(L)));
+	return 1;
+}
+
+static int lualog_sync (lua_State *L)
+{
+	lua_Log *self = checklog(L);
+	if (self->fd >= 0)
+		fsync(self->fd);
+	self->unsynced = 0;
+	return 0;
+}
+
+static int lualog_close (lua_State *L)
+{
+	lua_Log *self = (lua_Log *)luaL_checkudata(L, 1, LUA_LOG);
+	size_t i;
+	if (self->fd >= 0)
+	{
+		fsync(self->fd);
+		close(self->fd);
+	}
+	self->fd = -1;
+	for (i = 0; i < self->nsegs; ++i)
+	{
+		if (self->segs[i].map)
+			munmap(self->segs[i].map, self->segs[i].mapped);
+		free(self->segs[i].index);
+	}
+	free(self->segs);
+	self->segs = NULL;
+	self->nsegs = self->capsegs = 0;
+	if (self->scratch)
+		buffer_delete(&self->scratch);
+	return 0;
+}
+
+static const struct luaL_Reg log_funcs[] = {
+	{"append", lualog_append},
+	{"get", lualog_get},
+	{"range", lualog_range},
+	{"find", lualog_find},
+	{"count", lualog_count},
+	{"sync", lualog_sync},
+	{"close", lualog_close},
+	{"__gc", lualog_close},
+	{NULL, NULL}
+};
+#endif
+
+#ifdef STREAM_THREADS
+/*
+ * parallel decode: the records after the read position are cut at top level
+ * boundaries by a byte scan, then each part is decoded by a thread with a
+ * private lua state running the given code. whatever the code returns per
+ * record is encoded into that worker's own output stream.
+ */
+#define PARALLEL_MAX	64
+
+LUALIB_API int luaopen_stream (lua_State *L);
+
+struct worker {
+	pthread_t thread;
+	int started;
+	const char *data;
+	size_t size;
+	const char *code;
+	size_t codelen;
+	int trusted;
+	int maxdepth;
+	buffer_t out;
+	size_t records;
+	char error[256];
+};
+
+/* end of the value at pos, 0 when it is cut short or bad */
+static size_t value_skip(const char *data, size_t pos, size_t size)
+{
+	stream_Iter it;
+	int depth = 0, type;
+	stream_iter_init(&it, data, size);
+	it.pos = pos;
+	do
+	{
+		type = stream_next(&it);
+		if (type == STREAM_TTABLE)
+			depth++;
+		else if (type == STREAM_TEND)
+			depth--;
+		if (type < STREAM_TNIL || depth < 0)
+			return 0;
+	} while (depth > 0);
+	return it.pos;
+}
+
+/* encodes the values from index from up to the top as separate records */
+static void worker_emit(lua_State *L, struct worker *w, int from)
+{
+	struct writer_t W;
+	int i, top = lua_gettop(L);
+	for (i = from; i <= top; ++i)
+	{
+		writer_init(L, &W, buffer_tell(&w->out));
+		buffer_writeobject(L, &w->out, i, &W);
+		lua_pop(L, 1);
+	}
+}
+
+/* runs protected in the worker state: map every record, then the optional finish */
+static int worker_main(lua_State *L)
+{
+	struct worker *w = (struct worker *)lua_touserdata(L, 1);
+	struct reader_t R;
+	size_t pos = 0;
+	int top;
+	lua_getglobal(L, "package");
+	lua_getfield(L, -1, "loaded");
+	lua_pushcfunction(L, luaopen_stream);
+	lua_call(L, 0, 1);
+	lua_setfield(L, -2, "stream");
+	lua_pop(L, 2);
+	/* the nesting limit of the calling state carries over */
+	lua_pushnumber(L, w->maxdepth);
+	lua_setfield(L, LUA_REGISTRYINDEX, LUA_MAXDEPTH);
+	if (luaL_loadbuffer(L, w->code, w->codelen, "=parallel"))
+		lua_error(L);
+	lua_call(L, 0, 2);
+	luaL_check(lua_isfunction(L, 2), "parallel code must return a function");
+	top = lua_gettop(L);
+	while (pos < w->size)
+	{
+		lua_settop(L, top);
+		reader_init(L, &R, pos);
+		R.trusted = w->trusted;
+		lua_pushvalue(L, 2);
+		pos = buffer_readobject(L, w->data, pos, w->size, &R);
+		lua_call(L, 1, LUA_MULTRET);
+		worker_emit(L, w, top + 2);
+		w->records++;
+	}
+	if (lua_isfunction(L, 3))
+	{
+		lua_settop(L, top);
+		lua_pushvalue(L, 3);
+		lua_call(L, 0, LUA_MULTRET);
+		worker_emit(L, w, top + 1);
+	}
+	return 0;
+}
+
+static void *worker_run(void *arg)
+{
+	struct worker *w = (struct worker *)arg;
+	lua_State *L = luaL_newstate();
+	if (!L)
+	{
+		strcpy(w->error, "out of memory");
+		return NULL;
+	}
+	luaL_openlibs(L);
+	lua_pushcfunction(L, worker_main);
+	lua_pushlightuserdata(L, w);
+	if (lua_pcall(L, 1, 0, 0))
+	{
+		const char *err = lua_tostring(L, -1);
+		snprintf(w->error, sizeof(w->error), "%s", err ? err : "error object is not a string");
+	}
+	lua_close(L);
+	return NULL;
+}
+
+/*
+ * s:parallel(code [, threads]) decodes the remaining records on threads.
+ * code is lua source returning map(v) and optionally finish(); returns an
+ * array of output streams, one per part in record order, and the record count.
+ * threads and states are per call, nothing outlives it to hold the module loaded
+ */
+static int luastream_parallel (lua_State *L)
+{
+	lua_Stream *self = (lua_Stream *)luaL_checkudata(L, 1, LUA_STREAM);
+	size_t codelen, size, pos = 0, start = 0, records = 0;
+	const char *code = luaL_checklstring(L, 2, &codelen), *data;
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int threads = luaL_optint(L, 3, cpus > 0 ? (int)MIN(cpus, PARALLEL_MAX) : 1), n = 0, i;
+	struct worker *workers;
+	const char *err = NULL;
+	luaL_check(self->buf, "%s (released) #1", LUA_STREAM);
+	luaL_check(threads >= 1 && threads <= PARALLEL_MAX, "bad thread count #3");
+	workers = (struct worker *)lua_newuserdata(L, threads * sizeof(struct worker));
+	memset(workers, 0, threads * sizeof(struct worker));
+	data = buffer_ptr(&self->buf) + self->pos;
+	size = buffer_tell(&self->buf) - self->pos;
+	/* cut into parts of about the same size, resizing the share for what is left */
+	while (pos < size)
+	{
+		size_t end = value_skip(data, pos, size);
+		luaL_check(end > pos, "bad record at %d", (int)(self->pos + pos));
+		pos = end;
+		if (pos == size || (n < threads - 1 && pos - start >= (size - start) / (threads - n)))
+		{
+			struct worker *w = &workers[n++];
+			w->data = data + start;
+			w->size = pos - start;
+			w->code = code;
+			w->codelen = codelen;
+			w->trusted = self->pos + pos <= self->valid;
+			w->maxdepth = state_maxdepth(L);
+			start = pos;
+		}
+	}
+	for (i = 0; i < n; ++i)
+		workers[i].out = buffer_new(BUFF_SIZE);
+	for (i = 1; i < n; ++i)
+		workers[i].started = pthread_create(&workers[i].thread, NULL, worker_run, &workers[i]) == 0;
+	/* the first part runs on the calling thread, as do parts that got no thread */
+	if (n > 0)
+		worker_run(&workers[0]);
+	for (i = 1; i < n; ++i)
+	{
+		if (workers[i].started)
+			pthread_join(workers[i].thread, NULL);
+		else
+			worker_run(&workers[i]);
+	}
+	for (i = 0; i < n; ++i)
+	{
+		if (workers[i].error[0] && !err)
+			err = workers[i].error;
+		records += workers[i].records;
+	}
+	if (err)
+	{
+		lua_pushstring(L, err);
+		for (i = 0; i < n; ++i)
+			buffer_delete(&workers[i].out);
+		lua_error(L);
+	}
+	lua_createtable(L, n, 0);
+	for (i = 0; i < n; ++i)
+	{
+		lua_Stream *s = (lua_Stream *)lua_newuserdata(L, sizeof(lua_Stream));
+		s->buf = workers[i].out;
+		s->pos = 0;
+		s->ref = LUA_REFNIL;
+		s->compact = 0;
+		s->valid = 0;
+		luaL_getmetatable(L, LUA_STREAM);
+		lua_setmetatable(L, -2);
+		lua_rawseti(L, -2, i + 1);
+	}
+	self->pos += size;
+	stream_autocompact(self);
+	lua_pushnumber(L, (lua_Number)records);
+	return 2;
+}
+#endif
+
+#ifdef STREAM_SHM
+/*
+ * single producer single consumer ring in posix shared memory. messages are
+ * framed as a 4 byte length and the encoded values, 8 byte aligned; a length
+ * of RING_WRAP sends the reader back to the start. head and tail only grow,
+ * the futex words are touched only when the other side is asleep.
+ */
+#define RING_MAGIC	0x53524e47
+#define RING_WRAP	0xffffffffu
+#define RING_ALIGN(n)	(((n) + 7) & ~(size_t)7)
+
+struct ring {
+	uint32_t magic;
+	uint32_t size;
+	char pad0[56];
+	uint64_t head;
+	uint32_t rseq;
+	uint32_t rwait;
+	char pad1[48];
+	uint64_t tail;
+	uint32_t wseq;
+	uint32_t wwait;
+	char pad2[48];
+	char data[0];
+};
+
+typedef struct lua_Ring {
+	struct ring *ring;
+	size_t mapped;
+	buffer_t scratch;
+	char name[NAME_MAX + 1];
+} lua_Ring;
+
+/* sleeps while *addr is val, up to ms (forever when negative), 0 once timed out */
+static int futex_wait(uint32_t *addr, uint32_t val, int ms)
+{
+	struct timespec ts, *timeout = NULL;
+	if (ms >= 0)
+	{
+		ts.tv_sec = ms / 1000;
+		ts.tv_nsec = (ms % 1000) * 1000000L;
+		timeout = &ts;
+	}
+	return syscall(SYS_futex, addr, FUTEX_WAIT, val, timeout, NULL, 0) == 0 || errno != ETIMEDOUT;
+}
+
+static void futex_wake(uint32_t *seq)
+{
+	__atomic_add_fetch(seq, 1, __ATOMIC_SEQ_CST);
+	syscall(SYS_futex, seq, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+/* waits until *counter is no longer at, the waiting flag tells the other side to wake us */
+static int ring_wait(uint64_t *counter, uint64_t at, uint32_t *seq, uint32_t *waiting, int ms)
+{
+	while (__atomic_load_n(counter, __ATOMIC_ACQUIRE) == at)
+	{
+		uint32_t val;
+		int ok;
+		if (ms == 0)
+			return 0;
+		__atomic_store_n(waiting, 1, __ATOMIC_SEQ_CST);
+		val = __atomic_load_n(seq, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(counter, __ATOMIC_SEQ_CST) != at)
+		{
+			__atomic_store_n(waiting, 0, __ATOMIC_SEQ_CST);
 			break;
 		}
-		++nb;
+		ok = futex_wait(seq, val, ms);
+		__atomic_store_n(waiting, 0, __ATOMIC_SEQ_CST);
+		if (!ok)
+			return 0;
+	}
+	return 1;
+}
+
+static lua_Ring *checkring(lua_State *L)
+{
+	lua_Ring *self = (lua_Ring *)luaL_checkudata(L, 1, LUA_RING);
+	luaL_check(self->ring, "%s (closed) #1", LUA_RING);
+	return self;
+}
+
+/* stream.shm(name, size) creates the ring, or maps the existing one of that name */
+static int luastream_shm (lua_State *L)
+{
+	size_t len, size = (size_t)luaL_optnumber(L, 2, 1 << 16);
+	const char *name = luaL_checklstring(L, 1, &len);
+	lua_Ring *self;
+	struct stat st;
+	int fd, created = 1;
+	luaL_check(len > 0 && len < NAME_MAX, "bad shm name #1");
+	size = RING_ALIGN(size);
+	luaL_check(size >= 64 && size <= 0x7ffffff8, "bad shm size #2");
+	self = (lua_Ring *)lua_newuserdata(L, sizeof(lua_Ring));
+	self->ring = NULL;
+	self->scratch = NULL;
+	sprintf(self->name, name[0] == '/' ? "%s" : "/%s", name);
+	luaL_getmetatable(L, LUA_RING);
+	lua_setmetatable(L, -2);
+	fd = shm_open(self->name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd < 0 && errno == EEXIST)
+	{
+		created = 0;
+		fd = shm_open(self->name, O_RDWR, 0600);
+	}
+	luaL_check(fd >= 0, "shm_open %s: %s", self->name, strerror(errno));
+	if (created && ftruncate(fd, sizeof(struct ring) + size) < 0)
+	{
+		close(fd);
+		shm_unlink(self->name);
+		luaL_error(L, "ftruncate %s: %s", self->name, strerror(errno));
+	}
+	/* the creator may still be sizing it */
+	while (fstat(fd, &st) == 0 && (size_t)st.st_size < sizeof(struct ring))
+		sched_yield();
+	self->mapped = (size_t)st.st_size;
+	self->ring = (struct ring *)mmap(NULL, self->mapped, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (self->ring == MAP_FAILED)
+	{
+		self->ring = NULL;
+		luaL_error(L, "mmap %s: %s", self->name, strerror(errno));
+	}
+	if (created)
+	{
+		self->ring->size = (uint32_t)size;
+		__atomic_store_n(&self->ring->magic, RING_MAGIC, __ATOMIC_RELEASE);
+	}
+	while (__atomic_load_n(&self->ring->magic, __ATOMIC_ACQUIRE) != RING_MAGIC)
+		sched_yield();
+	luaL_check(sizeof(struct ring) + self->ring->size <= self->mapped, "bad shm ring %s", self->name);
+	self->scratch = buffer_new(BUFF_SIZE);
+	return 1;
+}
+
+/*
+ * q:write(...) sends the values as one message, waiting while the ring is full.
+ * a message takes at most half the ring, so that one that has to wrap always
+ * fits once the reader caught up
+ */
+static int luaring_write (lua_State *L)
+{
+	lua_Ring *self = checkring(L);
+	struct ring *r = self->ring;
+	struct writer_t W;
+	uint64_t head, tail;
+	size_t len, need, off, room;
+	int i, top = lua_gettop(L);
+	buffer_remove(&self->scratch, 0, buffer_tell(&self->scratch));
+	writer_init(L, &W, 0);
+	for (i = 2; i <= top; ++i, W.pos = buffer_tell(&self->scratch), W.count = 0)
+		buffer_writeobject(L, &self->scratch, i, &W);
+	len = buffer_tell(&self->scratch);
+	need = RING_ALIGN(8 + len);
+	luaL_check(need <= r->size / 2, "message of %d bytes does not fit the ring", (int)len);
+	head = r->head;
+	for (;;)
+	{
+		off = head % r->size;
+		room = r->size - off < need ? r->size - off + need : need;
+		tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+		if (r->size - (head - tail) >= room)
+			break;
+		ring_wait(&r->tail, tail, &r->wseq, &r->wwait, -1);
+	}
+	if (room > need)
+	{
+		*(uint32_t *)(r->data + off) = RING_WRAP;
+		head += r->size - off;
+		off = 0;
+	}
+	*(uint32_t *)(r->data + off) = (uint32_t)len;
+	memcpy(r->data + off + 8, buffer_ptr(&self->scratch), len);
+	__atomic_store_n(&r->head, head + need, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&r->rwait, __ATOMIC_SEQ_CST))
+		futex_wake(&r->rseq);
+	return 0;
+}
+
+/* q:read([timeout]) decodes the next message, nil, 'timeout' when none came in time */
+static int luaring_read (lua_State *L)
+{
+	lua_Ring *self = checkring(L);
+	struct ring *r = self->ring;
+	struct reader_t R;
+	int ms = (int)luaL_optinteger(L, 2, -1), nb = 0;
+	uint64_t tail = r->tail;
+	uint32_t len;
+	size_t off, pos, end;
+	const char *data;
+	for (;;)
+	{
+		if (!ring_wait(&r->head, tail, &r->rseq, &r->rwait, ms))
+		{
+			lua_pushnil(L);
+			lua_pushliteral(L, "timeout");
+			return 2;
+		}
+		off = tail % r->size;
+		len = *(uint32_t *)(r->data + off);
+		if (len != RING_WRAP)
+			break;
+		tail += r->size - off;
+		__atomic_store_n(&r->tail, tail, __ATOMIC_SEQ_CST);
+	}
+	end = len;
+	if (len > r->size - off - 8)
+	{
+		/* the framing can not be trusted past it, drop everything queued */
+		__atomic_store_n(&r->tail, __atomic_load_n(&r->head, __ATOMIC_ACQUIRE), __ATOMIC_SEQ_CST);
+		luaL_error(L, "bad message in %s", self->name);
+	}
+	/* the peer is another process and may still change the bytes, validate and decode a copy */
+	buffer_remove(&self->scratch, 0, buffer_tell(&self->scratch));
+	buffer_write(&self->scratch, r->data + off + 8, len);
+	__atomic_store_n(&r->tail, tail + RING_ALIGN(8 + len), __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&r->wwait, __ATOMIC_SEQ_CST))
+		futex_wake(&r->wseq);
+	data = buffer_ptr(&self->scratch);
+	luaL_check(buffer_validate(data, 0, end, state_maxdepth(L)) == end, "bad message in %s", self->name);
+	lua_settop(L, 1);
+	reader_init(L, &R, 0);
+	R.trusted = 1;
+	for (pos = 0; pos < end; ++nb, R.pos = pos, R.count = 0)
+	{
+		luaL_checkstack(L, 2, "too many values in message");
+		pos = buffer_readobject(L, data, pos, end, &R);
 	}
 	return nb;
 }
 
+/* bytes queued, ring capacity */
+static int luaring_size (lua_State *L)
+{
+	lua_Ring *self = checkring(L);
+	struct ring *r = self->ring;
+	lua_pushnumber(L, (lua_Number)(__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE)));
+	lua_pushnumber(L, r->size);
+	return 2;
+}
+
+static int luaring_close (lua_State *L)
+{
+	lua_Ring *self = (lua_Ring *)luaL_checkudata(L, 1, LUA_RING);
+	if (self->ring)
+		munmap(self->ring, self->mapped);
+	if (self->scratch)
+		buffer_delete(&self->scratch);
+	self->ring = NULL;
+	return 0;
+}
+
+/* removes the name, mappings stay valid until closed */
+static int luaring_unlink (lua_State *L)
+{
+	lua_Ring *self = (lua_Ring *)luaL_checkudata(L, 1, LUA_RING);
+	lua_pushboolean(L, shm_unlink(self->name) == 0);
+	return 1;
+}
+
+static const struct luaL_Reg ring_funcs[] = {
+	{"write", luaring_write},
+	{"read", luaring_read},
+	{"size", luaring_size},
+	{"close", luaring_close},
+	{"unlink", luaring_unlink},
+	{"__gc", luaring_close},
+	{NULL, NULL}
+};
+#endif
+
 static const struct luaL_Reg funcs[] = {
 	{"new", luastream_new},
 	{"clone", luastream_clone},
@@ -926,8 +5074,20 @@ static const struct luaL_Reg funcs[] = {
 	{"write", luastream_write},
 	{"insert", luastream_insert},
 	{"read", luastream_read},
+	{"writeall", luastream_writeall},
+	{"readall", luastream_readall},
+	{"each", luastream_each},
+#ifdef STREAM_THREADS
+	{"parallel", luastream_parallel},
+#endif
 	{"remove", luastream_remove},
 	{"seek", luastream_seek},
+	{"validate", luastream_validate},
+	{"compact", luastream_compact},
+	{"autocompact", luastream_autocompact},
+	{"reserve", luastream_reserve},
+	{"shrink", luastream_shrink},
+	{"capacity", luastream_capacity},
 	{"tell", luastream_tell},
 	{"unread", luastream_unread},
 	{"size", luastream_size},
@@ -936,6 +5096,32 @@ static const struct luaL_Reg funcs[] = {
 	{"writef", luastream_writef},
 	{"insertf", luastream_insertf},
 	{"readf", luastream_readf},
+#ifdef STREAM_FDIO
+	{"writeto", luastream_writeto},
+	{"writev", luastream_writev},
+	{"readfrom", luastream_readfrom},
+	{"pipe", luastream_pipe},
+	{"closefd", luastream_closefd},
+#endif
+#ifdef STREAM_SHM
+	{"shm", luastream_shm},
+#endif
+	{"chain", luastream_chain},
+#ifdef STREAM_LOG
+	{"log", luastream_log},
+#endif
+	{"diff", luastream_diff},
+	{"patch", luastream_patch},
+	{"tomsgpack", luastream_tomsgpack},
+	{"frommsgpack", luastream_frommsgpack},
+	{"tojson", luastream_tojson},
+	{"fromjson", luastream_fromjson},
+	{"freeze", luastream_freeze},
+	{"thaw", luastream_thaw},
+	{"register", luastream_register},
+	{"maxdepth", luastream_maxdepth},
+	{"stats", luastream_stats},
+	{"resetstats", luastream_resetstats},
 	{"tostring", luastream_tostring},
 	{"release", luastream_release},
 	{"__gc", luastream_release},
@@ -944,8 +5130,29 @@ static const struct luaL_Reg funcs[] = {
 	{NULL, NULL}
 };
 
+/* metatable of a handle type, methods through __index */
+static void newclass(lua_State *L, const char *tname, const struct luaL_Reg *r)
+{
+	luaL_newmetatable(L, tname);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+	for (; r->name; ++r)
+	{
+		lua_pushcfunction(L, r->func);
+		lua_setfield(L, -2, r->name);
+	}
+	lua_pop(L, 1);
+}
+
 LUALIB_API int luaopen_stream (lua_State *L)
 {
+#ifdef STREAM_SHM
+	newclass(L, LUA_RING, ring_funcs);
+#endif
+	newclass(L, LUA_CHAIN, chain_funcs);
+#ifdef STREAM_LOG
+	newclass(L, LUA_LOG, log_funcs);
+#endif
 	luaL_newmetatable(L, LUA_STREAM);
 	lua_pushvalue(L, -1);
 	lua_setfield(L, -2, "__index");
@@ -970,9 +5177,12 @@ lua_Stream *stream_new(lua_State *L)
 	lua_Stream *self = (lua_Stream *)lua_newuserdata(L, sizeof(lua_Stream));
 	self->buf = buffer_new(BUFF_SIZE);
 	self->pos = 0;
+	self->compact = 0;
+	self->valid = 0;
 	luaL_getmetatable(L, LUA_STREAM);
 	lua_setmetatable(L, -2);
 	self->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	return self;
 }
 
 lua_Stream *stream_ref(lua_State *L, int index)
@@ -1027,6 +5237,8 @@ void stream_read(lua_Stream *self, size_t pos, void *data, size_t size)
 void stream_insert(lua_Stream *self, size_t pos, const void *data, size_t size)
 {
 	assert(pos <= stream_size(self));
+	if (pos < self->valid)
+		self->valid = 0;
 	buffer_insert(&self->buf, pos, data, size);
 }
 
@@ -1034,11 +5246,319 @@ void stream_remove(lua_Stream *self, size_t pos, size_t size)
 {
 	assert(pos + size <= stream_size(self));
 	buffer_remove(&self->buf, pos, size);
+	if (self->valid > pos)
+		self->valid = pos + size <= self->pos ? self->valid - size : 0;
 	if (self->pos >= pos + size) self->pos -= size;
 	else if(self->pos >= pos) self->pos = pos;
 }
 
+void stream_reserve(lua_Stream *self, size_t size)
+{
+	buffer_reserve(&self->buf, size);
+}
+
+void stream_shrink(lua_Stream *self)
+{
+	buffer_shrink(&self->buf);
+}
+
+void stream_compact(lua_Stream *self)
+{
+	if (self->pos > 0)
+		stream_remove(self, 0, self->pos);
+}
+
+void stream_register(lua_State *L, int type, const char *tname, stream_Encoder encoder, stream_Decoder decoder)
+{
+	luaL_getmetatable(L, tname);
+	luaL_check(lua_istable(L, -1), "unknown type %s", tname);
+	ext_register(L, type, lua_gettop(L), encoder, decoder);
+	lua_pop(L, 1);
+}
+
 char *stream_ptr(lua_Stream *self)
 {
 	return buffer_ptr(&self->buf);
 }
+
+void stream_seek(lua_Stream *self, size_t pos)
+{
+	assert(pos <= stream_size(self));
+	self->pos = pos;
+	self->valid = 0;
+}
+
+int stream_view(lua_Stream *self, stream_View *view)
+{
+	if (!self->buf)
+		return 0;
+	view->data = buffer_ptr(&self->buf);
+	view->size = buffer_tell(&self->buf);
+	view->pos = self->pos;
+	return 1;
+}
+
+char *stream_prepare(lua_Stream *self, size_t size)
+{
+	return buffer_prepare(&self->buf, size);
+}
+
+void stream_commit(lua_Stream *self, size_t size)
+{
+	buffer_commit(&self->buf, size);
+}
+
+lua_Stream *stream_alloc(void)
+{
+	lua_Stream *self = (lua_Stream *)malloc(sizeof(lua_Stream));
+	self->buf = buffer_new(BUFF_SIZE);
+	self->pos = 0;
+	self->ref = LUA_NOREF;
+	self->compact = 0;
+	self->valid = 0;
+	return self;
+}
+
+void stream_free(lua_Stream *self)
+{
+	buffer_delete(&self->buf);
+	free(self);
+}
+
+void stream_put_nil(lua_Stream *self)
+{
+	buffer_writebyte(&self->buf, OP_NIL);
+}
+
+void stream_put_bool(lua_Stream *self, int b)
+{
+	buffer_writebyte(&self->buf, b ? OP_TRUE : OP_FALSE);
+}
+
+void stream_put_int(lua_Stream *self, lua_Integer n)
+{
+	buffer_writeinteger(&self->buf, n);
+}
+
+void stream_put_number(lua_Stream *self, lua_Number n)
+{
+	buffer_writenumber(&self->buf, n);
+}
+
+void stream_put_string(lua_Stream *self, const char *str, size_t len)
+{
+	buffer_writestring(&self->buf, str, len);
+}
+
+void stream_begin_array(lua_Stream *self)
+{
+	buffer_writebyte(&self->buf, OP_TABLE);
+}
+
+void stream_end_array(lua_Stream *self)
+{
+	buffer_writebyte(&self->buf, OP_TABLE_DELIMITER);
+	buffer_writebyte(&self->buf, OP_TABLE_END);
+}
+
+void stream_begin_table(lua_Stream *self)
+{
+	buffer_writebyte(&self->buf, OP_TABLE);
+	buffer_writebyte(&self->buf, OP_TABLE_DELIMITER);
+}
+
+void stream_end_table(lua_Stream *self)
+{
+	buffer_writebyte(&self->buf, OP_TABLE_END);
+}
+
+void stream_iter_init(stream_Iter *it, const void *data, size_t size)
+{
+	memset(it, 0, sizeof(*it));
+	it->data = (const char *)data;
+	it->size = size;
+	it->type = STREAM_TNONE;
+}
+
+void stream_iter(lua_Stream *self, stream_Iter *it)
+{
+	stream_iter_init(it, buffer_ptr(&self->buf), buffer_tell(&self->buf));
+	it->pos = self->pos;
+}
+
+/* reads a little endian size of len bytes */
+static int iter_size(stream_Iter *it, int len, size_t *n)
+{
+	*n = 0;
+	if (len > sizeof(*n) || it->pos + len > it->size)
+		return 0;
+	memcpy(n, it->data + it->pos, len);
+	correctbytes(n, sizeof(*n));
+	it->pos += len;
+	return 1;
+}
+
+int stream_next(stream_Iter *it)
+{
+	size_t start = it->pos;
+	int op, len;
+	if (it->pos >= it->size)
+		return it->type = STREAM_TNONE;
+	op = (unsigned char)it->data[it->pos++];
+	len = (op & 0xf0) >> 4;
+	switch(opcodes[op])
+	{
+		case OP_NIL:
+			it->type = STREAM_TNIL;
+			break;
+		case OP_TRUE:
+		case OP_FALSE:
+			it->type = STREAM_TBOOLEAN;
+			it->boolean = opcodes[op] == OP_TRUE;
+			break;
+		case OP_ZERO:
+			it->type = STREAM_TINTEGER;
+			it->integer = 0;
+			break;
+		case OP_FIXINT:
+			it->type = STREAM_TINTEGER;
+			it->integer = op - FIXINT_BASE;
+			break;
+		case OP_INT:
+		{
+			lua_Integer n = 0;
+			if (len > sizeof(n) || it->pos + len > it->size)
+				goto error;
+			memcpy(&n, it->data + it->pos, len);
+			correctbytes(&n, sizeof(n));
+			it->pos += len;
+			it->type = STREAM_TINTEGER;
+			it->integer = n;
+			break;
+		}
+		case OP_FLOAT:
+		{
+			if (it->pos + len > it->size)
+				goto error;
+			if (len == 0)
+				it->number = 0;
+			else if (len == sizeof(float))
+			{
+				float n;
+				memcpy(&n, it->data + it->pos, len);
+				correctbytes(&n, len);
+				it->number = n;
+			}
+			else if (len == sizeof(double))
+			{
+				double n;
+				memcpy(&n, it->data + it->pos, len);
+				correctbytes(&n, len);
+				it->number = n;
+			}
+			else
+				goto error;
+			it->pos += len;
+			it->type = STREAM_TNUMBER;
+			break;
+		}
+		case OP_FIXSTR:
+			it->length = op - FIXSTR_BASE;
+			goto string;
+		case OP_STRING:
+			if (!iter_size(it, len, &it->length))
+				goto error;
+		string:
+			if (it->length > it->size - it->pos)
+				goto error;
+			it->string = it->data + it->pos;
+			it->pos += it->length;
+			it->type = STREAM_TSTRING;
+			break;
+		case OP_TABLE:
+			it->type = STREAM_TTABLE;
+			break;
+		case OP_TABLE_DELIMITER:
+			it->type = STREAM_TDELIMITER;
+			break;
+		case OP_TABLE_END:
+			it->type = STREAM_TEND;
+			break;
+		case OP_TABLE_REF:
+			if (len == 0)
+			{
+				if (it->pos >= it->size)
+					goto error;
+				it->ref = (unsigned char)it->data[it->pos++];
+			}
+			else if (!iter_size(it, len, &it->ref))
+				goto error;
+			it->type = STREAM_TREF;
+			break;
+		case OP_EXT:
+			if (it->pos >= it->size)
+				goto error;
+			it->ext = (unsigned char)it->data[it->pos++];
+			if (!iter_size(it, len, &it->length) || it->length > it->size - it->pos)
+				goto error;
+			it->string = it->data + it->pos;
+			it->pos += it->length;
+			it->type = STREAM_TEXT;
+			break;
+		default:
+			goto error;
+	}
+	return it->type;
+error:
+	it->pos = start;
+	return it->type = STREAM_TERROR;
+}
+
+int stream_get_bool(stream_Iter *it, int *b)
+{
+	stream_Iter next = *it;
+	if (stream_next(&next) != STREAM_TBOOLEAN)
+		return 0;
+	*it = next;
+	*b = next.boolean;
+	return 1;
+}
+
+int stream_get_int(stream_Iter *it, lua_Integer *n)
+{
+	stream_Iter next = *it;
+	if (stream_next(&next) != STREAM_TINTEGER)
+		return 0;
+	*it = next;
+	*n = next.integer;
+	return 1;
+}
+
+int stream_get_number(stream_Iter *it, lua_Number *n)
+{
+	stream_Iter next = *it;
+	switch (stream_next(&next))
+	{
+		case STREAM_TINTEGER:
+			*n = (lua_Number)next.integer;
+			break;
+		case STREAM_TNUMBER:
+			*n = next.number;
+			break;
+		default:
+			return 0;
+	}
+	*it = next;
+	return 1;
+}
+
+int stream_get_string(stream_Iter *it, const char **str, size_t *len)
+{
+	stream_Iter next = *it;
+	if (stream_next(&next) != STREAM_TSTRING)
+		return 0;
+	*it = next;
+	*str = next.string;
+	*len = next.length;
+	return 1;
+}
@@ -4,6 +4,48 @@
 
 typedef struct lua_Stream lua_Stream;
 
+/* item types returned by stream_next */
+enum {
+	STREAM_TERROR = -2,
+	STREAM_TNONE = -1,
+	STREAM_TNIL,
+	STREAM_TBOOLEAN,
+	STREAM_TINTEGER,
+	STREAM_TNUMBER,
+	STREAM_TSTRING,
+	STREAM_TTABLE,
+	STREAM_TDELIMITER,
+	STREAM_TEND,
+	STREAM_TREF,
+	STREAM_TEXT,
+};
+
+/* pull reader over encoded bytes, the fields matching type hold the current item */
+typedef struct stream_Iter {
+	const char *data;
+	size_t pos;
+	size_t size;
+	int type;
+	int boolean;
+	lua_Integer integer;
+	lua_Number number;
+	const char *string;
+	size_t length;
+	int ext;
+	size_t ref;
+} stream_Iter;
+
+/* flat snapshot for ffi callers, stale once the stream is written or read through other calls */
+typedef struct stream_View {
+	char *data;
+	size_t size;
+	size_t pos;
+} stream_View;
+
+/* ext type hooks: the encoder returns the raw bytes of the value at index, the decoder pushes the value back */
+typedef const void *(*stream_Encoder)(lua_State *L, int index, size_t *size);
+typedef void (*stream_Decoder)(lua_State *L, const void *data, size_t size);
+
 lua_Stream *stream_new(lua_State *L);
 lua_Stream *stream_ref(lua_State *L, int index);
 void stream_unref(lua_State *L, lua_Stream *self);
@@ -14,4 +56,35 @@ void stream_write(lua_Stream *self, const void *data, size_t size);
 void stream_read(lua_Stream *self, size_t pos, void *data, size_t size);
 void stream_insert(lua_Stream *self, size_t pos, const void *data, size_t size);
 void stream_remove(lua_Stream *self, size_t pos, size_t size);
-char *stream_ptr(lua_Stream *self);
\ No newline at end of file
+void stream_compact(lua_Stream *self);
+void stream_reserve(lua_Stream *self, size_t size);
+void stream_shrink(lua_Stream *self);
+char *stream_ptr(lua_Stream *self);
+void stream_register(lua_State *L, int type, const char *tname, stream_Encoder encoder, stream_Decoder decoder);
+void stream_seek(lua_Stream *self, size_t pos);
+
+/* stable abi for stream_ffi.lua, keep in step with its cdef */
+int stream_view(lua_Stream *self, stream_View *view);
+char *stream_prepare(lua_Stream *self, size_t size);
+void stream_commit(lua_Stream *self, size_t size);
+
+/* lua free streams and encoding, same wire format as stream:write */
+lua_Stream *stream_alloc(void);
+void stream_free(lua_Stream *self);
+void stream_put_nil(lua_Stream *self);
+void stream_put_bool(lua_Stream *self, int b);
+void stream_put_int(lua_Stream *self, lua_Integer n);
+void stream_put_number(lua_Stream *self, lua_Number n);
+void stream_put_string(lua_Stream *self, const char *str, size_t len);
+void stream_begin_array(lua_Stream *self);
+void stream_end_array(lua_Stream *self);
+void stream_begin_table(lua_Stream *self);
+void stream_end_table(lua_Stream *self);
+
+void stream_iter_init(stream_Iter *it, const void *data, size_t size);
+void stream_iter(lua_Stream *self, stream_Iter *it);
+int stream_next(stream_Iter *it);
+int stream_get_bool(stream_Iter *it, int *b);
+int stream_get_int(stream_Iter *it, lua_Integer *n);
+int stream_get_number(stream_Iter *it, lua_Number *n);
+int stream_get_string(stream_Iter *it, const char **str, size_t *len);
\ No newline at end of file
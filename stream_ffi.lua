@@ -0,0 +1,168 @@
+-- fixed width field access for LuaJIT through FFI, the same layout as writef/readf.
+-- on PUC Lua (or a big endian host) the same api falls back to readf/writef.
+--
+--	local sf = require 'stream_ffi'
+--	local r = sf.reader(s)          -- cursor at the read position
+--	local id, x = r:D(), r:f()
+--	r:commit()                      -- moves the read position of s
+--	local w = sf.writer(s, 12)      -- room for 12 bytes on the end of s
+--	w:D(id) w:f(x)
+--	w:commit()                      -- appends what was written
+--
+-- a cursor holds a raw pointer into the buffer, do not touch the stream
+-- through other calls between creating it and its commit (or r:sync()).
+
+local stream = require 'stream'
+
+local M = {}
+
+local ok, ffi = pcall(require, 'ffi')
+local lib
+
+if ok and ffi.abi('le') then
+	ffi.cdef [[
+		typedef struct lua_Stream lua_Stream;
+		typedef struct stream_View {
+			char *data;
+			size_t size;
+			size_t pos;
+		} stream_View;
+		int stream_view(lua_Stream *self, stream_View *view);
+		char *stream_prepare(lua_Stream *self, size_t size);
+		void stream_commit(lua_Stream *self, size_t size);
+		void stream_seek(lua_Stream *self, size_t pos);
+	]]
+	local path = package.searchpath and package.searchpath('stream', package.cpath)
+	local loaded, found = pcall(ffi.load, path)
+	lib = loaded and found or ffi.C
+	if not pcall(function() return lib.stream_view end) then
+		lib = nil
+	end
+end
+
+M.ffi = lib ~= nil
+
+local types = {
+	b = {'int8_t *', 1},
+	B = {'uint8_t *', 1},
+	w = {'int16_t *', 2},
+	W = {'uint16_t *', 2},
+	d = {'long *'},
+	D = {'unsigned long *'},
+	f = {'double *', 8},
+}
+
+local Reader = {}
+Reader.__index = Reader
+
+local Writer = {}
+Writer.__index = Writer
+
+if lib then
+	local view = ffi.new('stream_View')
+
+	local function handle(s)
+		return ffi.cast('lua_Stream *', s)
+	end
+
+	for k, t in pairs(types) do
+		local ct, n = t[1], t[2] or ffi.sizeof(t[1]:sub(1, -3))
+		local convert = k == 'f' and function(v) return v end or tonumber
+		Reader[k] = function(self)
+			local pos = self.pos
+			if pos + n > self.size then
+				error("read '" .. k .. "' overflow", 2)
+			end
+			self.pos = pos + n
+			return convert(ffi.cast(ct, self.data + pos)[0])
+		end
+		Writer[k] = function(self, v)
+			local pos = self.pos
+			if pos + n > self.size then
+				error("write '" .. k .. "' overflow", 2)
+			end
+			ffi.cast(ct, self.data + pos)[0] = v
+			self.pos = pos + n
+		end
+	end
+
+	function Reader:s(n)
+		local pos = self.pos
+		if pos + n > self.size then
+			error("read 's' overflow", 2)
+		end
+		self.pos = pos + n
+		return ffi.string(self.data + pos, n)
+	end
+
+	function Reader:sync()
+		if lib.stream_view(self.handle, view) == 0 then
+			error('stream released', 2)
+		end
+		self.data, self.size, self.pos = view.data, tonumber(view.size), tonumber(view.pos)
+	end
+
+	function Reader:commit()
+		lib.stream_seek(self.handle, self.pos)
+	end
+
+	function Writer:s(str)
+		local pos, n = self.pos, #str
+		if pos + n > self.size then
+			error("write 's' overflow", 2)
+		end
+		ffi.copy(self.data + pos, str, n)
+		self.pos = pos + n
+	end
+
+	function Writer:commit()
+		lib.stream_commit(self.handle, self.pos)
+		self.data, self.size, self.pos = self.data + self.pos, self.size - self.pos, 0
+	end
+
+	function M.reader(s)
+		local r = setmetatable({handle = handle(s)}, Reader)
+		r:sync()
+		return r
+	end
+
+	function M.writer(s, size)
+		local w = setmetatable({handle = handle(s), size = size, pos = 0}, Writer)
+		if lib.stream_view(w.handle, view) == 0 then
+			error('stream released', 2)
+		end
+		w.data = lib.stream_prepare(w.handle, size)
+		return w
+	end
+else
+	for k in pairs(types) do
+		Reader[k] = function(self)
+			return self.stream:readf(k)
+		end
+		Writer[k] = function(self, v)
+			self.stream:writef(k, v)
+		end
+	end
+
+	function Reader:s(n)
+		return self.stream:readf('s' .. n)
+	end
+
+	function Writer:s(str)
+		self.stream:writef('s', str)
+	end
+
+	function Reader:sync() end
+	function Reader:commit() end
+	function Writer:commit() end
+
+	function M.reader(s)
+		return setmetatable({stream = s}, Reader)
+	end
+
+	function M.writer(s)
+		return setmetatable({stream = s}, Writer)
+	end
+end
+
+return M